@@ -0,0 +1,95 @@
+/*
+ * crc.c
+ *
+ * CRC-32 engine, see crc.h
+ */
+
+#include "crc.h"
+#include "libmaple_types.h"
+
+#if CRC_HW
+#include "rcc.h"
+
+typedef struct crc_reg_map {
+	__IO uint32 DR;		// Data register
+	__IO uint32 IDR;	// Independent data register
+	__IO uint32 CR;		// Control register
+} crc_reg_map;
+
+#define CRC_REGS		((struct crc_reg_map*)0x40023000)
+#define CRC_CR_RESET	(1U << 0)
+#endif
+
+//-----------------------------------------------------------------------------
+// next 4 bits of the CRC register shifted out, MSB first.
+// Not const, it is read by the ISR while the flash is busy.
+//-----------------------------------------------------------------------------
+static uint32_t crc_table[16] = {
+	0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+	0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
+};
+//-----------------------------------------------------------------------------
+static inline uint32_t crc_word_sw(uint32_t crc, uint32_t word)
+{
+	crc ^= word;
+	for (int i = 0; i < 8; i++)
+		crc = (crc<<4) ^ crc_table[crc>>28];
+	return crc;
+}
+//-----------------------------------------------------------------------------
+// little endian word from up to 4 bytes, zero padded
+//-----------------------------------------------------------------------------
+static inline uint32_t crc_tail(const uint8_t * p, int n)
+{
+	uint32_t word = 0;
+	for (int i = 0; i < n; i++)
+		word |= (uint32_t)p[i] << (8*i);
+	return word;
+}
+//-----------------------------------------------------------------------------
+__ramfunc uint32_t crc_calc_sw(const void * buff, int len)
+{
+	const uint8_t * p = buff;
+	uint32_t crc = 0xFFFFFFFF;
+	for ( ; len>=4; len -= 4, p += 4)
+		crc = crc_word_sw(crc, crc_tail(p, 4));
+	if (len>0)
+		crc = crc_word_sw(crc, crc_tail(p, len));
+	return crc;
+}
+
+#if CRC_HW
+//-----------------------------------------------------------------------------
+void crc_init(void)
+{
+	rcc_clk_enable(RCC_CRC);
+}
+//-----------------------------------------------------------------------------
+uint32_t crc_calc(const void * buff, int len)
+{
+	const uint8_t * p = buff;
+	CRC_REGS->CR = CRC_CR_RESET;
+	if ( ((uint32_t)p & 3)==0 )
+	{	// aligned, feed the words directly
+		const uint32_t * w = (const uint32_t*)p;
+		for ( ; len>=4; len -= 4)
+			CRC_REGS->DR = *w++;
+		p = (const uint8_t*)w;
+	}
+	for ( ; len>=4; len -= 4, p += 4)
+		CRC_REGS->DR = crc_tail(p, 4);
+	if (len>0)
+		CRC_REGS->DR = crc_tail(p, len);
+	return CRC_REGS->DR;
+}
+#else
+//-----------------------------------------------------------------------------
+void crc_init(void)
+{
+}
+//-----------------------------------------------------------------------------
+uint32_t crc_calc(const void * buff, int len)
+{
+	return crc_calc_sw(buff, len);
+}
+#endif
@@ -0,0 +1,35 @@
+/*
+ * crc.h
+ *
+ * CRC-32 engine, bit exact with the STM32 CRC unit:
+ * polynomial 0x04C11DB7, initial value 0xFFFFFFFF, no reflection, no final XOR.
+ * The data is processed as 32 bit little endian words, a trailing partial
+ * word is padded with zero bytes.
+ *
+ * crc_calc() uses the CRC unit. The unit holds the running state, so it is
+ * only used from the main loop. crc_calc_sw() is a nibble table driven
+ * software implementation giving the same result, it can be used from the
+ * USB ISR and it builds on the host.
+ *
+ * With CRC_BENCH set, CrcBench() (main.c) measures the cycles per KB of both
+ * against the additive Check_CRC() loop on the target.
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+
+#ifndef CRC_HW
+#define CRC_HW	1 // 0: crc_calc() uses the software implementation
+#endif
+
+#ifndef CRC_BENCH
+#define CRC_BENCH	0 // 1: measure the CRC kernels against Check_CRC() at start-up
+#endif
+
+extern void crc_init(void);
+extern uint32_t crc_calc(const void * buff, int len);
+extern uint32_t crc_calc_sw(const void * buff, int len);
+
+#endif // CRC_H
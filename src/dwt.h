@@ -0,0 +1,32 @@
+/*
+ * dwt.h
+ *
+ * Cortex-M3 DWT cycle counter, counts core clocks (72 MHz) and wraps
+ * after ~59 s. Differences of two readings are valid across one wrap.
+ */
+
+#ifndef DWT_H
+#define DWT_H
+
+#include <stdint.h>
+
+#define DEMCR			(*(volatile uint32_t *)0xE000EDFC)
+#define DEMCR_TRCENA	(1U << 24)
+#define DWT_CTRL		(*(volatile uint32_t *)0xE0001000)
+#define DWT_CTRL_CYCCNTENA	(1U << 0)
+#define DWT_CYCCNT		(*(volatile uint32_t *)0xE0001004)
+
+//-----------------------------------------------------------------------------
+static inline void dwt_init(void)
+{
+	DEMCR |= DEMCR_TRCENA;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+//-----------------------------------------------------------------------------
+static inline uint32_t dwt_cycles(void)
+{
+	return DWT_CYCCNT;
+}
+
+#endif // DWT_H
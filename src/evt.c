@@ -0,0 +1,53 @@
+/*
+ * evt.c
+ *
+ * Binary event tracer, see evt.h
+ */
+
+#include "evt.h"
+#include "dwt.h"
+#include "libmaple_types.h"
+
+evt_t evt_ring[EVT_LEN];
+volatile uint32_t evt_head, evt_tail; // put / read records
+volatile uint32_t evt_lost;
+
+//-----------------------------------------------------------------------------
+// Reserves a slot with a compare and swap (LDREX/STREX), so a put from an ISR
+// can preempt a put from the main loop. The reader only runs in the main loop,
+// it never sees a reserved but incomplete record.
+//-----------------------------------------------------------------------------
+__ramfunc void evt_put(uint16_t id, uint16_t arg0, uint32_t arg1)
+{
+	uint32_t h = evt_head;
+	do {
+		if ( (h - evt_tail)>=EVT_LEN )
+		{
+			evt_lost++;
+			return;
+		}
+	} while ( !__atomic_compare_exchange_n(&evt_head, &h, h+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+
+	evt_t * e = &evt_ring[h & (EVT_LEN-1)];
+	e->time = dwt_cycles();
+	e->id = id;
+	e->arg0 = arg0;
+	e->arg1 = arg1;
+}
+//-----------------------------------------------------------------------------
+int evt_count(void)
+{
+	return evt_head - evt_tail;
+}
+//-----------------------------------------------------------------------------
+// main loop only: removes the oldest record, false if none
+//-----------------------------------------------------------------------------
+bool evt_get(evt_t * e)
+{
+	uint32_t t = evt_tail;
+	if (t==evt_head)
+		return false;
+	*e = evt_ring[t & (EVT_LEN-1)];
+	evt_tail = t + 1;
+	return true;
+}
@@ -0,0 +1,67 @@
+/*
+ * evt.h
+ *
+ * Binary event tracer. Unlike trace(), an event costs a few cycles only,
+ * so a real upload can be traced without changing its timing.
+ *
+ * Each event is a fixed size record in a RAM ring. The records are written
+ * by evt_put() lock-free from the ISRs and from the main loop, a full ring
+ * drops the new event and counts it in evt_lost. The main loop drains the
+ * ring over EP_DATA IN on request, see CMD_ID_EVENTS.
+ *
+ * Record format, 12 bytes, little endian:
+ *   uint32_t time   DWT cycle counter (core clocks) when the event was put
+ *   uint16_t id     enum evt_id
+ *   uint16_t arg0   see the event list
+ *   uint32_t arg1
+ * The records come in the order of the slot reservation, an ISR preempting
+ * a put may stamp an earlier time. A host decoder unwraps 'time' into a
+ * 64 bit timeline, sorts by it and divides by the core clock (72 MHz).
+ */
+
+#ifndef EVT_H
+#define EVT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef EVT_TRACE
+#define EVT_TRACE	0 // takes EVT_LEN * 12 bytes SRAM
+#endif
+
+#define EVT_LEN		64 // records, power of two
+
+enum evt_id {				// arg0			arg1
+	EVT_USB_IRQ = 1,		// USB_ISTR
+	EVT_RESET,				//
+	EVT_SUSPEND,			//
+	EVT_RX,					// EP			bytes
+	EVT_TX,					// EP			bytes
+	EVT_NAK,				// 				v2: rx_remaining, the packet is held in PMA
+	EVT_PAGE_QUEUED,		// len			flash address
+	EVT_FLASH_ERASE,		// 				flash address
+	EVT_FLASH_PROGRAM,		// halfwords	flash address
+	EVT_PAGE_DONE,			// error_t		flash address
+	EVT_REPORT,				// report id	error_t
+	EVT_ERROR,				// error_t
+};
+
+typedef struct evt_t {
+	uint32_t time;
+	uint16_t id;
+	uint16_t arg0;
+	uint32_t arg1;
+} evt_t;
+
+extern volatile uint32_t evt_lost;
+extern void evt_put(uint16_t id, uint16_t arg0, uint32_t arg1);
+extern int evt_count(void);
+extern bool evt_get(evt_t * e);
+
+#if EVT_TRACE
+#define EVT(id, arg0, arg1)	evt_put(id, arg0, arg1)
+#else
+#define EVT(id, arg0, arg1)
+#endif
+
+#endif // EVT_H
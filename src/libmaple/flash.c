@@ -33,6 +33,7 @@
 #include "libmaple_types.h"
 #include "flash.h"
 #include "nvic.h"
+#include "prof.h"
 
 /**
  * @brief Set flash wait states
@@ -56,6 +57,42 @@ void flash_set_latency(uint32 wait_states)
     FLASH->ACR = val;
 }
 
+#if FLASH_STATS
+//-----------------------------------------------------------------------------
+// Counters of all operations
+//-----------------------------------------------------------------------------
+volatile flash_stats_t flash_stats;
+#endif
+
+//-----------------------------------------------------------------------------
+// count a finished operation, 'start' in DWT cycles
+//-----------------------------------------------------------------------------
+static inline void flash_account(bool erase, uint32 start, uint16_t halfwords)
+{
+#if FLASH_STATS || PROFILE
+	uint32 t = dwt_cycles() - start;
+#else
+	(void)start;
+#endif
+#if FLASH_STATS
+	if (erase)
+	{
+		flash_stats.erased++;
+		flash_stats.erase_cycles += t;
+	}
+	else
+	{
+		flash_stats.programmed += halfwords;
+		flash_stats.program_cycles += t;
+	}
+#else
+	(void)halfwords;
+#endif
+#if PROFILE
+	prof_add(erase ? PROF_FLASH_ERASE : PROF_FLASH_WRITE, t);
+#endif
+}
+
 //-----------------------------------------------------------------------------
 // Reference: RM0008 chap. 3.3.3.
 //-----------------------------------------------------------------------------
@@ -77,31 +114,186 @@ WRITE:
  - Write to destination (16-bit in a half-word aligned address)
  - Wait on BUSY
 */
+// Both functions return the error flags FLASH_SR_PGERR and FLASH_SR_WRPRTERR.
 //-----------------------------------------------------------------------------
-void flash_erase_page(uint16_t *page)
+// Both run from SRAM, so that interrupts are served while the flash is busy.
+//-----------------------------------------------------------------------------
+__ramfunc uint32 flash_erase_page(uint16_t *page)
 {
 	// Unlock Flash with magic keys
 	flash_unlock();
 	flash_wait_for_ready();
+	flash_clear_errors();
 
+	uint32 start = dwt_cycles();
 	// Erase page
 	flash_set_cr(FLASH_CR_PER); // erase page flag
 	flash_set_page((uint32_t) page);
 	flash_start();
 
 	flash_wait_for_ready();
+	flash_account(true, start, 0);
+	return flash_errors();
 }
 
 //-----------------------------------------------------------------------------
-void flash_write_data(uint16_t *page, uint16_t *data, uint16_t size)
+__ramfunc uint32 flash_write_data(uint16_t *page, uint16_t *data, uint16_t size)
 {
 	flash_set_cr(FLASH_CR_PG); // erase program flag
+	uint32 start = dwt_cycles();
+	uint16_t count = size;
 
 	while (size--)
 	{
 		*page++ = *data++;
 
 		flash_wait_for_ready();
+		if ( flash_errors() )
+			break; // not erased or write protected
+	}
+	flash_account(false, start, count);
+	return flash_errors();
+}
+
+//-----------------------------------------------------------------------------
+// Same as flash_write_data(), but the source holds one halfword in the lower
+// half of each 32 bit word, like the USB packet memory.
+//-----------------------------------------------------------------------------
+__ramfunc uint32 flash_write_pma(uint16_t *page, const uint32_t *src, uint16_t size)
+{
+	flash_set_cr(FLASH_CR_PG); // erase program flag
+	uint32 start = dwt_cycles();
+	uint16_t count = size;
+
+	while (size--)
+	{
+		*page++ = *src++;
+
+		flash_wait_for_ready();
+		if ( flash_errors() )
+			break; // not erased or write protected
 	}
+	flash_account(false, start, count);
+	return flash_errors();
 }
 
+//-----------------------------------------------------------------------------
+// Asynchronous erase and program. The operation is started here and the
+// flash interrupt (EOP or error) continues it, so the CPU is free meanwhile.
+// Programming writes the next halfword on each EOP interrupt.
+// Without RAM_CODE the CPU would stall on the next flash fetch anyway, so the
+// operations complete before they return.
+//-----------------------------------------------------------------------------
+static volatile struct {
+	flash_state_t state;
+	uint16_t * dest;
+	const uint16_t * src;
+	uint16_t count;
+	uint16_t size; // halfwords of the programming
+	uint32 errors;
+	uint32 start; // DWT cycles
+} flash_op;
+
+//-----------------------------------------------------------------------------
+void flash_async_init(void)
+{
+	flash_op.state = FLASH_STATE_IDLE;
+#if RAM_CODE
+	nvic_irq_enable(NVIC_FLASH);
+#endif
+}
+//-----------------------------------------------------------------------------
+void flash_async_deinit(void)
+{
+#if RAM_CODE
+	nvic_irq_disable(NVIC_FLASH);
+#endif
+	flash_set_cr(0);
+}
+//-----------------------------------------------------------------------------
+flash_state_t flash_state(void)
+{
+	return flash_op.state;
+}
+//-----------------------------------------------------------------------------
+// error flags of the last asynchronous operation
+//-----------------------------------------------------------------------------
+uint32 flash_result(void)
+{
+	return flash_op.errors;
+}
+#if RAM_CODE
+//-----------------------------------------------------------------------------
+__ramfunc void flash_begin_erase(uint16_t *page)
+{
+	flash_unlock();
+	flash_wait_for_ready();
+	flash_clear_errors();
+
+	flash_op.errors = 0;
+	flash_op.state = FLASH_STATE_ERASE;
+	flash_op.start = dwt_cycles();
+	flash_set_cr(FLASH_CR_PER | FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+	flash_set_page((uint32_t) page);
+	flash_start();
+}
+//-----------------------------------------------------------------------------
+__ramfunc void flash_begin_program(uint16_t *dest, const uint16_t *src, uint16_t size)
+{
+	flash_wait_for_ready();
+	flash_clear_errors();
+
+	flash_op.errors = 0;
+	if (size==0)
+	{
+		flash_op.state = FLASH_STATE_DONE;
+		return;
+	}
+	flash_op.dest = dest + 1;
+	flash_op.src = src + 1;
+	flash_op.count = size - 1;
+	flash_op.size = size;
+	flash_op.state = FLASH_STATE_PROGRAM;
+	flash_op.start = dwt_cycles();
+	flash_set_cr(FLASH_CR_PG | FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+	*dest = *src;
+}
+//-----------------------------------------------------------------------------
+__ramfunc void FLASH_IRQHandler(void)
+{
+	uint32 sr = FLASH->SR;
+	flash_clear_errors();
+	bool erase = (flash_op.state==FLASH_STATE_ERASE);
+
+	if (sr & FLASH_SR_ERRORS)
+	{	// not erased or write protected
+		flash_op.errors = sr & FLASH_SR_ERRORS;
+		flash_op.state = FLASH_STATE_ERROR;
+	}
+	else if ( flash_op.state==FLASH_STATE_PROGRAM && flash_op.count )
+	{
+		flash_op.count--;
+		*flash_op.dest++ = *flash_op.src++;
+		return;
+	}
+	else
+	{
+		flash_op.state = FLASH_STATE_DONE;
+	}
+	flash_set_cr(0);
+	flash_account(erase, flash_op.start, flash_op.size);
+}
+#else
+//-----------------------------------------------------------------------------
+void flash_begin_erase(uint16_t *page)
+{
+	flash_op.errors = flash_erase_page(page);
+	flash_op.state = flash_op.errors ? FLASH_STATE_ERROR : FLASH_STATE_DONE;
+}
+//-----------------------------------------------------------------------------
+void flash_begin_program(uint16_t *dest, const uint16_t *src, uint16_t size)
+{
+	flash_op.errors = flash_write_data(dest, (uint16_t*)src, size);
+	flash_op.state = flash_op.errors ? FLASH_STATE_ERROR : FLASH_STATE_DONE;
+}
+#endif
@@ -78,8 +78,47 @@ extern "C"{
  */
 
 extern void flash_set_latency(uint32 wait_states);
-void flash_erase_page(uint16_t *page);
-extern void flash_write_data(uint16_t *page, uint16_t *data, uint16_t size);
+extern uint32 flash_erase_page(uint16_t *page);
+extern uint32 flash_write_data(uint16_t *page, uint16_t *data, uint16_t size);
+extern uint32 flash_write_pma(uint16_t *page, const uint32_t *src, uint16_t size);
+
+// Counters of all erase and program operations, blocking or asynchronous
+#ifndef FLASH_STATS
+#define FLASH_STATS 0
+#endif
+typedef struct flash_stats_t {
+	uint32 erased;			// pages erased
+	uint32 programmed;		// halfwords programmed (requested)
+	uint32 erase_cycles;	// cumulative busy time, DWT cycles
+	uint32 program_cycles;
+} flash_stats_t;
+
+extern volatile flash_stats_t flash_stats;
+
+/*
+ * Asynchronous erase and program, completed by the flash interrupt
+ */
+
+typedef enum flash_state_t {
+	FLASH_STATE_IDLE,
+	FLASH_STATE_ERASE,		// page erase running
+	FLASH_STATE_PROGRAM,	// programming running
+	FLASH_STATE_DONE,		// finished without error
+	FLASH_STATE_ERROR		// finished with FLASH_SR_PGERR or FLASH_SR_WRPRTERR, see flash_result()
+} flash_state_t;
+
+extern void flash_async_init(void);
+extern void flash_async_deinit(void);
+extern void flash_begin_erase(uint16_t *page);
+extern void flash_begin_program(uint16_t *dest, const uint16_t *src, uint16_t size);
+extern flash_state_t flash_state(void);
+extern uint32 flash_result(void);
+extern void FLASH_IRQHandler(void);
+
+static inline bool flash_busy(void) {
+	flash_state_t st = flash_state();
+	return (st==FLASH_STATE_ERASE || st==FLASH_STATE_PROGRAM);
+}
 
 /**
  * @brief Enable Flash memory features
@@ -123,6 +162,16 @@ static inline void flash_wait_for_ready(void) {
 	while (FLASH->SR & FLASH_SR_BSY);
 }
 
+#define FLASH_SR_ERRORS		(FLASH_SR_PGERR | FLASH_SR_WRPRTERR)
+
+static inline uint32 flash_errors(void) {
+	return (FLASH->SR & FLASH_SR_ERRORS);
+}
+
+static inline void flash_clear_errors(void) {
+	FLASH->SR = FLASH_SR_ERRORS | FLASH_SR_EOP; // write 1 to clear
+}
+
 static inline void flash_set_cr(int cr)
 {
 	FLASH->CR = cr;
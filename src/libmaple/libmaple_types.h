@@ -58,6 +58,18 @@ typedef void (*voidArgumentFuncPtr)(void *);
 #define __packed __attribute__((__packed__))
 #define __deprecated __attribute__((__deprecated__))
 #define __weak __attribute__((weak))
+// executed from SRAM, keeps running while the flash is erased or programmed.
+// With RAM_CODE 0 it stays in flash, the CPU stalls during flash operations.
+#ifndef RAM_CODE
+#define RAM_CODE 0
+#endif
+#if RAM_CODE && defined(__arm__)
+#define __ramfunc __attribute__((section (".ramfunc"), noinline))
+#elif RAM_CODE // host simulation: a section of its own, so that the simulator knows the SRAM code
+#define __ramfunc __attribute__((section ("ramfunc"), noinline))
+#else
+#define __ramfunc
+#endif
 #ifndef __unused
 #define __unused __attribute__((unused))
 #endif
@@ -66,7 +66,7 @@ const struct rcc_dev_info rcc_dev_table[] = {
 //	[RCC_DMA1]   = { .clk_domain = AHB,  .line_num = 0 },
 //	[RCC_I2C1]   = { .clk_domain = APB1, .line_num = 21 },
 //	[RCC_I2C2]   = { .clk_domain = APB1, .line_num = 22 },
-//	[RCC_CRC]    = { .clk_domain = AHB,  .line_num = 6},
+	[RCC_CRC]    = { .clk_domain = AHB,  .line_num = 6},
 //	[RCC_FLITF]  = { .clk_domain = AHB,  .line_num = 4},
 //	[RCC_SRAM]   = { .clk_domain = AHB,  .line_num = 2},
 #if STM32_NR_GPIO_PORTS > 4
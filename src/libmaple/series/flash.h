@@ -59,7 +59,10 @@ typedef struct flash_reg_map {
     __IO uint32 WRPR;           /**< Write protection register */
 } flash_reg_map;
 
-#define FLASH                      ((struct flash_reg_map*)0x40022000)
+#ifndef FLASH_REG_BASE
+#define FLASH_REG_BASE             0x40022000 /* can be predefined for a host build */
+#endif
+#define FLASH                      ((struct flash_reg_map*)FLASH_REG_BASE)
 
 /*
  * Register bit definitions
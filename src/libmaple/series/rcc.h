@@ -240,7 +240,7 @@ typedef struct rcc_reg_map {
 
 #define RCC_AHBENR_SDIOEN_BIT           10
 #define RCC_AHBENR_FSMCEN_BIT           8
-#define RCC_AHBENR_CRCEN_BIT            7
+#define RCC_AHBENR_CRCEN_BIT            6
 #define RCC_AHBENR_FLITFEN_BIT          4
 #define RCC_AHBENR_SRAMEN_BIT           2
 #define RCC_AHBENR_DMA2EN_BIT           1
@@ -400,11 +400,11 @@ typedef enum rcc_clk_id
 	RCC_GPIOA,
 	RCC_GPIOB,
 	RCC_GPIOC,
+	RCC_CRC,
 //   RCC_ADC1,
 //    RCC_ADC2,
 //    RCC_ADC3,
 //    RCC_AFIO,
-//    RCC_CRC,
 //    RCC_DAC,
 //    RCC_DMA1,
 //    RCC_DMA2,
@@ -42,7 +42,7 @@ void (*systick_user_callback)(void);
  * SysTick ISR
  */
 
-__weak void __exc_systick(void) {
+__weak __ramfunc void __exc_systick(void) {
     systick_uptime_millis++;
     if (systick_user_callback) {
         systick_user_callback();
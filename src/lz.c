@@ -0,0 +1,109 @@
+/*
+ * lz.c
+ *
+ * Streaming LZSS decoder, see lz.h
+ */
+
+#include "lz.h"
+#include "libmaple_types.h"
+
+enum {
+	LZ_CTRL,	// waiting for a control byte
+	LZ_LIT_IN,	// waiting for a literal
+	LZ_B0,		// waiting for the first match byte
+	LZ_B1,		// waiting for the second match byte
+	LZ_LIT,		// literal to output
+	LZ_COPY		// match to output
+};
+
+//-----------------------------------------------------------------------------
+void lz_init(lz_t * lz)
+{
+	lz->total = 0;
+	lz->nbits = 0;
+	lz->state = LZ_CTRL;
+}
+//-----------------------------------------------------------------------------
+// true while decoded bytes are waiting for the output
+//-----------------------------------------------------------------------------
+bool lz_busy(lz_t * lz)
+{
+	return (lz->state==LZ_LIT || lz->state==LZ_COPY);
+}
+//-----------------------------------------------------------------------------
+static inline void lz_next_item(lz_t * lz)
+{
+	if (lz->nbits==0)
+	{
+		lz->state = LZ_CTRL;
+		return;
+	}
+	lz->state = (lz->ctrl & 1) ? LZ_B0 : LZ_LIT_IN;
+	lz->ctrl >>= 1;
+	lz->nbits--;
+}
+//-----------------------------------------------------------------------------
+static inline bool lz_out(lz_t * lz, uint8_t b, lz_put_t put)
+{
+	if ( !put(b) )
+		return false;
+	lz->window[lz->total & (LZ_WINDOW-1)] = b;
+	lz->total++;
+	return true;
+}
+//-----------------------------------------------------------------------------
+// Returns the number of input bytes consumed, -1 on a format error.
+// Less than 'len' bytes are consumed when the output refused a byte.
+//-----------------------------------------------------------------------------
+__ramfunc int lz_decode(lz_t * lz, const uint8_t * in, int len, lz_put_t put)
+{
+	int n = 0;
+	for (;;)
+	{
+		if (lz->state==LZ_LIT)
+		{
+			if ( !lz_out(lz, lz->b0, put) )
+				return n;
+			lz_next_item(lz);
+		}
+		else if (lz->state==LZ_COPY)
+		{
+			while (lz->len)
+			{
+				if ( !lz_out(lz, lz->window[(lz->total - lz->dist) & (LZ_WINDOW-1)], put) )
+					return n;
+				lz->len--;
+			}
+			lz_next_item(lz);
+		}
+		else
+		{
+			if (n>=len)
+				return n;
+			uint8_t c = in[n++];
+			switch (lz->state)
+			{
+			case LZ_CTRL:
+				lz->ctrl = c;
+				lz->nbits = 8;
+				lz_next_item(lz);
+				break;
+			case LZ_LIT_IN:
+				lz->b0 = c;
+				lz->state = LZ_LIT;
+				break;
+			case LZ_B0:
+				lz->b0 = c;
+				lz->state = LZ_B1;
+				break;
+			case LZ_B1:
+				lz->dist = (lz->b0 | ((c & 0x03)<<8)) + 1;
+				lz->len = (c>>2) + LZ_MIN_MATCH;
+				if (lz->dist>lz->total)
+					return -1; // reference before the start of the image
+				lz->state = LZ_COPY;
+				break;
+			}
+		}
+	}
+}
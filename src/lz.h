@@ -0,0 +1,46 @@
+/*
+ * lz.h
+ *
+ * Streaming LZSS decoder for compressed upload images.
+ *
+ * Format: each group of up to 8 items is preceded by a control byte,
+ * its bits are used from bit 0 upwards.
+ *   bit = 0: literal, one byte copied to the output
+ *   bit = 1: match, two bytes b0 b1:
+ *            dist = (b0 | (b1 & 0x03)<<8) + 1     1 .. LZ_WINDOW
+ *            len  = (b1 >> 2) + LZ_MIN_MATCH      3 .. 66
+ *            copy 'len' bytes starting 'dist' bytes back in the output
+ * The stream simply ends after the last item, unused control bits are ignored.
+ *
+ * The input can be fed in pieces of any size. The output goes byte-wise to
+ * a callback which may refuse a byte when it has no room, lz_decode() then
+ * returns and continues with the same byte on the next call.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LZ_WINDOW		1024 // history size, power of two
+#define LZ_MIN_MATCH	3
+
+typedef bool (*lz_put_t)(uint8_t b);
+
+typedef struct lz_t {
+	uint8_t window[LZ_WINDOW]; // the last LZ_WINDOW output bytes
+	uint32_t total; // number of output bytes so far
+	uint16_t dist; // pending match
+	uint8_t len;
+	uint8_t ctrl; // control bits not used yet
+	uint8_t nbits;
+	uint8_t state;
+	uint8_t b0;
+} lz_t;
+
+extern void lz_init(lz_t * lz);
+extern int lz_decode(lz_t * lz, const uint8_t * in, int len, lz_put_t put);
+extern bool lz_busy(lz_t * lz);
+
+#endif // LZ_H
@@ -16,14 +16,18 @@
 
 #include "bkp.h"
 #include "nvic.h"
+#include "dwt.h"
 
 
 
 int flash_complete;
+uint32_t flash_size;
+uint16_t flash_page_size;
 //-----------------------------------------------------------------------------
 // Interrupt handlers
 //-----------------------------------------------------------------------------
-void SysTick_Handler(void)
+// at the priority of the USB interrupt, it must not stall on a flash fetch either
+__ramfunc void SysTick_Handler(void)
 {
 	__exc_systick();
 }
@@ -63,6 +67,15 @@ void Setup_sys()
 {
 	crt_page = 0;
 	num_pages = 0;
+
+	// flash geometry of this device: up to 128 KB 1 KB pages, above 2 KB pages
+	uint32_t kb = FLASH_SIZE_REG;
+	if ( kb==0 || kb==0xFFFF )
+		kb = 64; // not programmed, assume the F103C8
+	if ( kb>(FLASH_SIZE_MAX/1024) )
+		kb = FLASH_SIZE_MAX/1024;
+	flash_size = kb * 1024;
+	flash_page_size = (kb>128) ? 2048 : 1024;
 }
 //-----------------------------------------------------------------------------
 // USB-Setup
@@ -82,6 +95,9 @@ void UsbSetup(void)
 
 	Setup_sys();
 	CMD.configuration = 0;
+#if PMA_BENCH
+	PmaBench();
+#endif
 
     Class_Start();            // setup LineCoding-Block with default values
 
@@ -107,7 +123,7 @@ void GpioToggle(void)
 }
 
 //-----------------------------------------------------------------------------
-int Check_CRC(uint8_t * buff, int len)
+__ramfunc int Check_CRC(uint8_t * buff, int len)
 {
 	if (len<=2) return 0;
 	len -= 2; // don't process the last two bytes, they are the CRC
@@ -124,21 +140,77 @@ int Check_CRC(uint8_t * buff, int len)
 	return (crc==temp);
 }
 //-----------------------------------------------------------------------------
-int Calculate_CRC(uint8_t * buff, int len)
+__ramfunc int Calculate_CRC(uint8_t * buff, int len)
 {
 	if (len==0) return 0;
 
-	uint16 crc = 0xFFFF; // init CRC
+	uint16 crc = 0; // init CRC, same as in Check_CRC()
 	while ( (len--)>0 )
 		crc += *buff++;
 
 	return (crc ^ 0xFFFF);
 }
+#if CRC_BENCH
+//-----------------------------------------------------------------------------
+// Cycle counts of the CRC kernels for 1 KB of flash against the additive
+// Check_CRC() loop, taken on the start of the bootloader image.
+// Best of CRC_BENCH_RUNS, in core clocks, timer overhead subtracted.
+//-----------------------------------------------------------------------------
+#define CRC_BENCH_RUNS	8
+enum {
+	CRC_BENCH_ADD,	// Check_CRC()
+	CRC_BENCH_HW,	// crc_calc(), the CRC unit if CRC_HW is set
+	CRC_BENCH_SW,	// crc_calc_sw()
+	CRC_BENCH_NUM
+};
+uint32_t crc_bench[CRC_BENCH_NUM];
+volatile uint32_t crc_bench_sink; // keeps the results alive
+//-----------------------------------------------------------------------------
+void CrcBench(void)
+{
+	uint8_t * buf = (uint8_t*)FLASH_BASE;
+
+	uint32_t t = dwt_cycles();
+	uint32_t overhead = dwt_cycles() - t;
+
+	for (int i = 0; i < CRC_BENCH_NUM; i++)
+	{
+		uint32_t best = 0xFFFFFFFF;
+		for (int r = 0; r < CRC_BENCH_RUNS; r++)
+		{
+			t = dwt_cycles();
+			switch (i)
+			{
+			case CRC_BENCH_ADD: crc_bench_sink = Check_CRC(buf, 1024); break;
+			case CRC_BENCH_HW: crc_bench_sink = crc_calc(buf, 1024); break;
+			case CRC_BENCH_SW: crc_bench_sink = crc_calc_sw(buf, 1024); break;
+			}
+			t = dwt_cycles() - t - overhead;
+			if (t<best)
+				best = t;
+		}
+		crc_bench[i] = best;
+		trace("crc bench "); ntrace(i, 0); trace(": "); ntrace(best, 1);
+	}
+}
+#endif
 //-----------------------------------------------------------------------------
 void yield(void)
 {
-	// check number of written pages
-	if ( num_pages>0 && crt_page==num_pages)
+	// erase and write received data into flash, outside of the USB ISR
+	ProcessRxQueue();
+
+	// send the requested page hashes
+	ProcessManifest();
+
+	// send the requested event trace records
+	ProcessEvents();
+
+	// run a requested flash timing measurement
+	ProcessFlashTiming();
+
+	// check if all received data has been flashed
+	if ( UploadComplete() )
 	{	// end of flashing process
 		flash_complete = true;
 		flash_lock();
@@ -148,9 +220,13 @@ void yield(void)
 static bool Check_user_code(uint32_t user_address)
 {
 	uint32_t sp = *(volatile uint32_t *) user_address;
+	uint32_t pc = *(volatile uint32_t *) (user_address + 4);
 
 	// Check if the stack pointer in the vector table points somewhere in SRAM
-	return ((sp & 0x2FFE0000) == SRAM_BASE) ? true : false;
+	// and the reset vector to Thumb code in flash behind the vector table.
+	// An image linked for the older layout at 0x08001000 mostly fails this.
+	return ((sp & 0x2FFE0000) == SRAM_BASE) &&
+		((pc & 0xFFF80001) == (FLASH_BASE | 1)) && (pc > user_address);
 }
 //-----------------------------------------------------------------------------
 static uint16_t Get_and_clear_magic_word(void)
@@ -170,14 +246,49 @@ static uint16_t Get_and_clear_magic_word(void)
 //-----------------------------------------------------------------------------
 void __set_MSP(uint32_t topOfMainStack)
 {
+#ifdef __arm__
 	asm volatile ("MSR msp, %0" : : "g" (topOfMainStack) );
+#else
+	(void)topOfMainStack; // host simulation build, see test/sim.h
+#endif
 }
 
+#if RAM_CODE
+//-----------------------------------------------------------------------------
+// Serve the interrupts from a vector table in SRAM, a vector fetch from flash
+// would stall while a page is erased or programmed.
+//-----------------------------------------------------------------------------
+#define NR_VECTORS		76 // as in startup_stm32.S
+uint32_t ram_vectors[NR_VECTORS] __attribute__((section (".ram_vector"), aligned(512)));
+
+static void Relocate_vectors(void)
+{
+	extern uint32_t g_pfnVectors[];
+	for (int i = 0; i < NR_VECTORS; i++)
+		ram_vectors[i] = g_pfnVectors[i];
+
+	nvic_set_vector_table((uint32_t)ram_vectors, 0);
+}
+#endif
 //-----------------------------------------------------------------------------
 void Main_init(void)
 {
+#if RAM_CODE
+    Relocate_vectors();
+#endif
+
     GpioToggle();
 
+    crc_init();
+
+    dwt_init(); // cycle counter for the upload statistics and benchmarks
+
+#if CRC_BENCH
+    CrcBench();
+#endif
+
+    flash_async_init();
+
     UsbSetup();
 
 	systick_init();
@@ -237,6 +348,7 @@ int main(void)
 		}
 		// turn off everything
 		USB_power_off();
+		flash_async_deinit();
 		systick_disable();
 
 		// go and jump to user program
@@ -0,0 +1,38 @@
+/*
+ * prof.c
+ *
+ * Profiling probes, see prof.h
+ */
+
+#include "prof.h"
+#include "libmaple_types.h"
+
+prof_t prof[PROF_NUM];
+
+//-----------------------------------------------------------------------------
+void prof_reset(int id)
+{
+	prof_t * p = &prof[id];
+	p->min = p->max = p->sum = p->count = 0;
+	for (int i = 0; i < PROF_HIST; i++)
+		p->hist[i] = 0;
+}
+//-----------------------------------------------------------------------------
+// Called from the ISRs and while the flash is busy, so it runs from SRAM.
+// Not reentrant, a nested pass of the same probe may be lost.
+//-----------------------------------------------------------------------------
+__ramfunc void prof_add(int id, uint32_t cycles)
+{
+	prof_t * p = &prof[id];
+	if (cycles<p->min || p->count==0)
+		p->min = cycles;
+	if (cycles>p->max)
+		p->max = cycles;
+	p->sum += cycles;
+	p->count++;
+	int bucket = (cycles>>PROF_HIST_SHIFT) ? (31 - __builtin_clz(cycles>>PROF_HIST_SHIFT)) : 0;
+	if (bucket>=PROF_HIST)
+		bucket = PROF_HIST-1;
+	if (p->hist[bucket]<0xFFFF)
+		p->hist[bucket]++;
+}
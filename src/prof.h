@@ -0,0 +1,57 @@
+/*
+ * prof.h
+ *
+ * Cycle accurate profiling probes on the DWT cycle counter (dwt.h).
+ *
+ * A probe aggregates the duration of each pass through a code region:
+ * min, max, sum and count in core clocks, plus a histogram with
+ * logarithmic buckets: bucket 0 counts < 2^(PROF_HIST_SHIFT+1) cycles,
+ * bucket i counts 2^(i+PROF_HIST_SHIFT) .. 2^(i+PROF_HIST_SHIFT+1)-1 cycles,
+ * the last bucket everything above. At 72 MHz: bucket 0 < 1.8 us,
+ * the last bucket >= 29 ms.
+ *
+ * The probes are read over USB with CMD_ID_PROFILE. With PROFILE 0 the
+ * macros expand to nothing.
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+#include "dwt.h"
+
+#ifndef PROFILE
+#define PROFILE		0
+#endif
+
+#define PROF_HIST		16
+#define PROF_HIST_SHIFT	6
+
+enum prof_id {
+	PROF_USB_IRQ,		// USB interrupt handler
+	PROF_CTR,			// one pass of the CTR loop, the handling of one packet
+	PROF_READ_PMA,		// Read_PMA()
+	PROF_SEND_DATA,		// SendData()
+	PROF_FLASH_ERASE,	// page erase, blocking or interrupt driven
+	PROF_FLASH_WRITE,	// programming, per call or per interrupt driven page
+	PROF_NUM
+};
+
+typedef struct prof_t {
+	uint32_t min, max, sum, count;
+	uint16_t hist[PROF_HIST];
+} prof_t;
+
+extern prof_t prof[PROF_NUM];
+extern void prof_add(int id, uint32_t cycles);
+extern void prof_reset(int id);
+
+#if PROFILE
+#define PROF_START(id)	uint32_t prof_t0_##id = dwt_cycles()
+#define PROF_END(id)	prof_add(id, dwt_cycles() - prof_t0_##id)
+#else
+#define PROF_START(id)
+#define PROF_END(id)
+#endif
+
+#endif // PROF_H
@@ -0,0 +1,102 @@
+/*
+ * queue.h
+ *
+ * Lock-free single-producer / single-consumer queue of fixed-size slots.
+ *
+ * The queue only manages the slot indexes, the slots themselves are
+ * an array owned by the user. The producer (the USB ISR) fills the slot
+ * returned by queue_wr_slot() and publishes it with queue_push(). The
+ * consumer (the main loop) processes the slot returned by queue_rd_slot()
+ * and releases it with queue_pop() afterwards.
+ *
+ * 'head' is only written by the producer, 'tail' only by the consumer,
+ * so no locking is needed. The barriers make sure that the slot content
+ * is complete before the index update becomes visible, and that a slot is
+ * only accessed after the index update of the other side was seen.
+ *
+ * The header also builds on the host (test/queue_test.c), there the
+ * barrier is a C11 fence and queue_reset() is not atomic.
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef __arm__
+#include "util/atomic.h"
+#else
+#define ATOMIC_BLOCK(type)	for (int __ToDo = 1; __ToDo; __ToDo = 0)
+#endif
+
+typedef struct queue_t {
+	volatile uint16_t head; // number of pushed slots, written by producer
+	volatile uint16_t tail; // number of popped slots, written by consumer
+	uint16_t size;          // number of slots, must be a power of two
+} queue_t;
+
+#define QUEUE_INIT(n)	{ .head = 0, .tail = 0, .size = (n) }
+
+//-----------------------------------------------------------------------------
+static inline void queue_barrier(void)
+{
+#ifdef __arm__
+	__asm__ volatile ("dmb" ::: "memory");
+#else
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+//-----------------------------------------------------------------------------
+static inline void queue_reset(queue_t * q)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		q->head = 0;
+		q->tail = 0;
+	}
+}
+//-----------------------------------------------------------------------------
+static inline int queue_count(queue_t * q)
+{
+	return (uint16_t)(q->head - q->tail);
+}
+//-----------------------------------------------------------------------------
+static inline bool queue_empty(queue_t * q)
+{
+	return q->head==q->tail;
+}
+//-----------------------------------------------------------------------------
+static inline bool queue_full(queue_t * q)
+{
+	return queue_count(q)>=q->size;
+}
+//-----------------------------------------------------------------------------
+// producer side
+//-----------------------------------------------------------------------------
+static inline int queue_wr_slot(queue_t * q)
+{
+	queue_barrier(); // the slot was released by the consumer before
+	return q->head & (q->size-1);
+}
+//-----------------------------------------------------------------------------
+static inline void queue_push(queue_t * q)
+{
+	queue_barrier(); // slot content must be written before it is published
+	q->head = q->head + 1;
+}
+//-----------------------------------------------------------------------------
+// consumer side
+//-----------------------------------------------------------------------------
+static inline int queue_rd_slot(queue_t * q)
+{
+	queue_barrier(); // the slot was published by the producer before
+	return q->tail & (q->size-1);
+}
+//-----------------------------------------------------------------------------
+static inline void queue_pop(queue_t * q)
+{
+	queue_barrier(); // slot must be completely processed before it is released
+	q->tail = q->tail + 1;
+}
+
+#endif // QUEUE_H
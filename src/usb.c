@@ -10,6 +10,8 @@
 #include "usbstd.h"
 #include "usb_func.h"
 #include "usb_desc.h"
+#include "queue.h"
+#include "dwt.h"
 
 
 //-----------------------------------------------------------------------------
@@ -31,15 +33,39 @@ status_t usb_state;
 
 uint16_t Dtr_Rts;
 uint8_t deviceAddress;
-const epTableAddress_t epTableAddr[2] = { //; // number of EPs
+// not const, it is read from RAM by the ISR while the flash is busy
+epTableAddress_t epTableAddr[EP_DATA_TX+1] = { //; // number of EPs
 	{ .txAddr = (uint32*)EP_CTRL_TX_BUF_ADDRESS, .rxAddr = (uint32*)EP_CTRL_RX_BUF_ADDRESS },
 	{ .txAddr = (uint32*)EP_DATA_TX_BUF_ADDRESS, .rxAddr = (uint32*)EP_DATA_RX_BUF_ADDRESS },
+#if EP_DATA_DBL_BUF
+	{ .txAddr = (uint32*)EP_COMM_TX_BUF_ADDRESS, .rxAddr = (uint32*)EP_COMM_RX_BUF_ADDRESS },
+	{ .txAddr = (uint32*)EP_DATA_IN_BUF_ADDRESS, .rxAddr = NULL },
+#else
 //	{ .txAddr = (uint32*)EP_COMM_TX_BUF_ADDRESS, .rxAddr = (uint32*)EP_COMM_RX_BUF_ADDRESS },
+#endif
 };
 
 // constant to send zero byte packets
 const uint8_t ZERO = 0;
 
+#if USB_STATS
+// runtime counters, see VENDOR_REQ_STATS
+usb_stats_t usb_stats;
+#define USB_STAT(x)		x
+#else
+#define USB_STAT(x)
+#endif
+#if USB_SOF_STATS
+// bus utilization, see VENDOR_REQ_FRAMES
+frame_stats_t frame_stats;
+struct {
+	uint16_t fn; // USB_FNR frame number
+	uint8_t out, in; // EP_DATA packets in this frame
+	bool nak;
+	bool valid;
+} frame;
+#endif
+
 //-----------------------------------------------------------------------------
 // Function to initialize the VCP
 //-----------------------------------------------------------------------------
@@ -76,6 +102,7 @@ void Stall_EPAddr(int epNum)
 	if ( epNum & 0x80 ) // IN EP
 	{
 		epNum &= 0x7F; // remove bit 7
+		if (epNum==EP_DATA) epNum = EP_DATA_TX;
 		mask = EP_MASK_NoToggleBits | STAT_RX; // without STAT_TX and without both DTOG_x
 		shift = 1 << 12;
 	}
@@ -96,6 +123,7 @@ void UnStall_EPAddr(int epNum)
 	if ( epNum & 0x80 )
 	{
 		epNum &= 0x7F; // remove bit 7
+		if (epNum==EP_DATA) epNum = EP_DATA_TX;
 		mask = EP_MASK_NoToggleBits | STAT_RX; // without STAT_TX and without both DTOG_x
 		shift = 3 << 12; // RX = VALID
 	}
@@ -124,7 +152,7 @@ void UnStall(int ep)
 //-----------------------------------------------------------------------------
 // mark EP ready to receive, set STAT_RX to "11" by toggling
 //-----------------------------------------------------------------------------
-void MarkBufferRxDone(int ep)
+__ramfunc void MarkBufferRxDone(int ep)
 {
 	strace("clrBuf logEpNum=%i\n", ep);
 	uint32_t mask = EP_MASK_NoToggleBits | STAT_RX; // without STAT_TX and without both DTOG_x
@@ -132,10 +160,51 @@ void MarkBufferRxDone(int ep)
 	USB_EpRegs(ep) = (data ^ STAT_RX) & mask;
 }
 
+#if EP_DATA_DBL_BUF
+//-----------------------------------------------------------------------------
+// double buffered Rx: the application reads the buffer selected by SW_BUF (= DTOG_TX)
+//-----------------------------------------------------------------------------
+static inline int GetDblBufIndex(int ep)
+{
+	return (USB_EpRegs(ep) & DTOG_TX) ? 1 : 0;
+}
+//-----------------------------------------------------------------------------
+// take the buffer just filled by the hardware by toggling SW_BUF (= DTOG_TX).
+// This releases the buffer taken before, so the hardware ACKs the next packet
+// into it while the taken one is read or held.
+//-----------------------------------------------------------------------------
+__ramfunc void TakeDblBufRx(int ep)
+{
+	strace("takeBuf logEpNum=%i\n", ep);
+	uint32_t data = USB_EpRegs(ep);
+	// CTR_RX and CTR_TX written as 1 keep their state
+	USB_EpRegs(ep) = (data & EP_MASK_NoToggleBits) | CTR_RX | CTR_TX | DTOG_TX;
+}
+#endif
+//-----------------------------------------------------------------------------
+// take the received EP_DATA packet, before it is read
+//-----------------------------------------------------------------------------
+static inline void TakeDataRx(void)
+{
+#if EP_DATA_DBL_BUF
+	TakeDblBufRx(EP_DATA);
+#endif
+}
+//-----------------------------------------------------------------------------
+// release the EP_DATA Rx buffer for the next OUT packet. Double buffered it
+// was already released when the packet was taken.
+//-----------------------------------------------------------------------------
+static inline void ReleaseDataRx(void)
+{
+#if !EP_DATA_DBL_BUF
+	MarkBufferRxDone(EP_DATA);
+#endif
+}
+
 //-----------------------------------------------------------------------------
 // mark EP ready to transmit, set STAT_TX to "11" by toggling
 //-----------------------------------------------------------------------------
-void MarkBufferTxReady(int ep)
+__ramfunc void MarkBufferTxReady(int ep)
 {
 	strace("validateBuf logEpNum=%i\n", ep);
 	uint32_t mask = EP_MASK_NoToggleBits | STAT_TX; // without STAT_RX and without both DTOG_x
@@ -168,11 +237,25 @@ void InitEndpoints(void)
 	EpTable[EP_CTRL].rxOffset = EP_CTRL_RX_OFFSET;
 	EpTable[EP_CTRL].rxCount = EP_RX_LEN_ID;
 
+#if EP_DATA_DBL_BUF
+	// EP1 = Bulk OUT, double buffered. The Tx descriptor is used for Rx buffer 0.
+	EpTable[EP_DATA].txOffset = EP_DATA_RX0_OFFSET;
+	EpTable[EP_DATA].txCount = EP_RX_LEN_ID;
+	EpTable[EP_DATA].rxOffset = EP_DATA_RX1_OFFSET;
+	EpTable[EP_DATA].rxCount = EP_RX_LEN_ID;
+
+	// EP3 = Bulk IN
+	EpTable[EP_DATA_TX].txOffset = EP_DATA_IN_OFFSET;
+	EpTable[EP_DATA_TX].txCount = 0;
+	EpTable[EP_DATA_TX].rxOffset = 0;
+	EpTable[EP_DATA_TX].rxCount = 0;
+#else
 	// EP1 = Bulk IN and OUT
 	EpTable[EP_DATA].txOffset = EP_DATA_TX_OFFSET;
 	EpTable[EP_DATA].txCount = 0;
 	EpTable[EP_DATA].rxOffset = EP_DATA_RX_OFFSET;
 	EpTable[EP_DATA].rxCount = EP_RX_LEN_ID;
+#endif
 
 	// EP2 = Int IN and OUT
 	EpTable[EP_COMM].txOffset = EP_COMM_TX_OFFSET;
@@ -189,11 +272,26 @@ void InitEndpoints(void)
 		(1 << 9) |		// EP_TYPE = 1, Control
 		EP_CTRL;
 	// DATA EP
+#if EP_DATA_DBL_BUF
+	USB_EP1R =			// EP1 = Bulk OUT, double buffered
+		(3 << 12) |		// STAT_RX = 3, Rx enabled
+		DTOG_TX |		// SW_BUF = 1, hardware starts with buffer 0, TakeDataRx() takes it
+		(0 << 4) |		// STAT_TX = 0, disabled
+		(0 << 9) |		// EP_TYPE = 0, Bulk
+		EP_KIND |		// DBL_BUF
+		EP_DATA;
+	USB_EP3R =			// EP3 = Bulk IN, same address as EP1
+		(0 << 12) |		// STAT_RX = 0, disabled
+		(2 << 4) |		// STAT_TX = 2, NAK
+		(0 << 9) |		// EP_TYPE = 0, Bulk
+		EP_DATA;
+#else
 	USB_EP1R =			// EP1 = Bulk IN and OUT
 		(3 << 12) |		// STAT_RX = 3, Rx enabled
 		(2 << 4) |		// STAT_TX = 2, NAK
 		(0 << 9) |		// EP_TYPE = 0, Bulk
 		EP_DATA;
+#endif
 	// COMM EP
 	USB_EP2R =			// EP2 = Int, IN und OUT
 		(3 << 12) |		// STAT_RX = 3, Rx enabled
@@ -205,78 +303,291 @@ void InitEndpoints(void)
 	USB_CNTR =
 		CTRM |             // Irq by ACKed Pakets
 		RESETM |           // Irq by Reset
+		ERRM | PMAOVRM |   // Irq by errors, only counted
+#if USB_SOF_STATS
+		SOFM |             // Irq by start of frame, 1 ms
+#endif
 		SUSPM | WKUPM;
 
 	USB_SetAddress(0);
 }
 
+#if PMA_FAST_COPY
+//-----------------------------------------------------------------------------
+// PMA copy kernels. Each PMA word holds one halfword of the packet
+// (UMEM_FAKEWIDTH), the upper half reads as don't care.
+//-----------------------------------------------------------------------------
+// copies 'n' halfwords from PMA into a halfword aligned buffer, no repacking
+//-----------------------------------------------------------------------------
+__ramfunc void Read_PMA16(uint16_t * dest, const uint32_t * src, int n)
+{
+	for ( ; n>=4; n -= 4, dest += 4, src += 4)
+	{
+		dest[0] = src[0];
+		dest[1] = src[1];
+		dest[2] = src[2];
+		dest[3] = src[3];
+	}
+	while (n--)
+		*dest++ = *src++;
+}
+//-----------------------------------------------------------------------------
+// copies 'n' words (2*n halfwords) from PMA into a word aligned buffer
+//-----------------------------------------------------------------------------
+__ramfunc static void Read_PMA32(uint32_t * dest, const uint32_t * src, int n)
+{
+	for ( ; n>=4; n -= 4, dest += 4, src += 8)
+	{
+		dest[0] = (uint16_t)src[0] | (src[1]<<16);
+		dest[1] = (uint16_t)src[2] | (src[3]<<16);
+		dest[2] = (uint16_t)src[4] | (src[5]<<16);
+		dest[3] = (uint16_t)src[6] | (src[7]<<16);
+	}
+	for ( ; n>0; n--, src += 2)
+		*dest++ = (uint16_t)src[0] | (src[1]<<16);
+}
+//-----------------------------------------------------------------------------
+// copies 'n' words (2*n halfwords) from a word aligned buffer into PMA
+//-----------------------------------------------------------------------------
+__ramfunc static void Write_PMA32(uint32_t * dest, const uint32_t * src, int n)
+{
+	for ( ; n>=4; n -= 4, dest += 8, src += 4)
+	{
+		uint32_t w0 = src[0], w1 = src[1], w2 = src[2], w3 = src[3];
+		dest[0] = w0; dest[1] = w0>>16;
+		dest[2] = w1; dest[3] = w1>>16;
+		dest[4] = w2; dest[5] = w2>>16;
+		dest[6] = w3; dest[7] = w3>>16;
+	}
+	for ( ; n>0; n--, dest += 2)
+	{
+		uint32_t w = *src++;
+		dest[0] = w; dest[1] = w>>16;
+	}
+}
+//-----------------------------------------------------------------------------
+// copies 'n' halfwords from a halfword aligned buffer into PMA
+//-----------------------------------------------------------------------------
+__ramfunc static void Write_PMA16(uint32_t * dest, const uint16_t * src, int n)
+{
+	for ( ; n>=4; n -= 4, dest += 4, src += 4)
+	{
+		dest[0] = src[0];
+		dest[1] = src[1];
+		dest[2] = src[2];
+		dest[3] = src[3];
+	}
+	while (n--)
+		*dest++ = *src++;
+}
+#endif
 //-----------------------------------------------------------------------------
 // reads up to a given number of even bytes from control EP receive buffer
 //-----------------------------------------------------------------------------
-void Read_PMA(uint8_t* dest, uint32_t * src, int count)
+__ramfunc void Read_PMA(uint8_t* dest, uint32_t * src, int count)
 {
 	trace("rx="); ntrace(count, 0); trace("-");
 
 	if (!count) return;
 
+	PROF_START(PROF_READ_PMA);
 	if (count > EP_DATA_LEN)
 		count = EP_DATA_LEN;
 
-	int i = count/2;
-	while (i--)
+	int n = count/2;
+#if PMA_FAST_COPY
+	if ( ((uint32_t)dest & 3)==0 )
 	{
-		UMEM_FAKEWIDTH val = *src++;
-		*dest++ = val;
-		*dest++ = val>>8;
+		Read_PMA32((uint32_t*)dest, src, n/2);
+		if (n&1)
+			((uint16_t*)dest)[n-1] = src[n-1];
+	}
+	else if ( ((uint32_t)dest & 1)==0 )
+	{
+		Read_PMA16((uint16_t*)dest, src, n);
+	}
+	else
+#endif
+	{
+		for (int i = 0; i < n; i++)
+		{
+			UMEM_FAKEWIDTH val = src[i];
+			dest[2*i] = val;
+			dest[2*i+1] = val>>8;
+		}
 	}
 	if (count&1) { // read last odd byte if any
-		UMEM_FAKEWIDTH val = *src;
-		*dest = val;
+		dest[count-1] = src[n];
 	}
+	PROF_END(PROF_READ_PMA);
+}
+//-----------------------------------------------------------------------------
+// returns the number of bytes received in the EP receive buffer
+//-----------------------------------------------------------------------------
+__ramfunc int GetRxCount(int ep)
+{
+#if EP_DATA_DBL_BUF
+	if (ep==EP_DATA && GetDblBufIndex(ep)==0)
+		return EpTable[ep].txCount & 0x3FF;
+#endif
+	return EpTable[ep].rxCount & 0x3FF;
+}
+//-----------------------------------------------------------------------------
+// returns the PMA buffer holding the received packet
+//-----------------------------------------------------------------------------
+static inline uint32_t * GetRxBuf(int ep)
+{
+#if EP_DATA_DBL_BUF
+	if (ep==EP_DATA && GetDblBufIndex(ep)==0)
+		return epTableAddr[ep].txAddr;
+#endif
+	return epTableAddr[ep].rxAddr;
 }
 //-----------------------------------------------------------------------------
 // reads up to a given number of even bytes from control EP receive buffer
 //-----------------------------------------------------------------------------
-void ReadData(int ep, uint8_t* dest, int count)
+__ramfunc void ReadData(int ep, uint8_t* dest, int count)
 {
-	int rd = EpTable[ep].rxCount & 0x3FF;
+	int rd = GetRxCount(ep);
 	if (count>rd)
 		count = rd;
-	Read_PMA(dest, epTableAddr[ep].rxAddr, count);
+	Read_PMA(dest, GetRxBuf(ep), count);
 	if (ep==EP_CTRL)
 		MarkBufferRxDone(EP_CTRL); // release EP0 Rx
 }
 //-----------------------------------------------------------------------------
 // writes up to 64 bytes into the specified EP transmit buffer
 //-----------------------------------------------------------------------------
-int SendData(int ep, uint8_t * src, int count)
+__ramfunc int SendData(int ep, uint8_t * src, int count)
 {
 	trace("tx="); ntrace(count, 0);
 
+	PROF_START(PROF_SEND_DATA);
 	if (count > EP_DATA_LEN)
 		count = EP_DATA_LEN;
+	EVT(EVT_TX, ep, count);
 
 	EpTable[ep].txCount = count;
 	if (count)
 	{
 		UMEM_FAKEWIDTH* dest = epTableAddr[ep].txAddr;
-		int j = count/2;
-		while (j--)
+		int n = count/2;
+#if PMA_FAST_COPY
+		if ( ((uint32_t)src & 3)==0 )
 		{
-		    register UMEM_FAKEWIDTH val = *src++;
-		    val |= (*src++) << 8;
-		    *dest++ = val;
+			Write_PMA32(dest, (uint32_t*)src, n/2);
+			if (n&1)
+				dest[n-1] = ((uint16_t*)src)[n-1];
 		}
-		if (count&1) // send last odd byte if any
+		else if ( ((uint32_t)src & 1)==0 )
+		{
+			Write_PMA16(dest, (uint16_t*)src, n);
+		}
+		else
+#endif
 		{
-		    register UMEM_FAKEWIDTH val = *src;
-		    *dest = val;
+			for (int i = 0; i < n; i++)
+				dest[i] = src[2*i] | (src[2*i+1] << 8);
 		}
+		if (count&1) // send last odd byte if any
+			dest[n] = src[count-1];
 	}
 	MarkBufferTxReady(ep); // mark Tx buffer ready to be sent
+	PROF_END(PROF_SEND_DATA);
 	return count;
 }
 
+#if PMA_BENCH
+//-----------------------------------------------------------------------------
+// Cycle counts of the PMA copy kernels for one full packet against the former
+// byte repacking loops, taken on the EP_DATA IN buffer before enumeration.
+// Best of PMA_BENCH_RUNS, in core clocks, timer overhead subtracted.
+//-----------------------------------------------------------------------------
+#define PMA_BENCH_RUNS	8
+enum {
+	BENCH_RD_REF,	// former Read_PMA() loop
+	BENCH_RD_32,	// Read_PMA(), word aligned destination
+	BENCH_RD_16,	// Read_PMA(), halfword aligned destination
+	BENCH_RD_8,		// Read_PMA(), odd destination
+	BENCH_WR_REF,	// former SendData() loop
+	BENCH_WR_32,
+	BENCH_WR_16,
+	BENCH_WR_8,
+	BENCH_NUM
+};
+uint32_t pma_bench[BENCH_NUM];
+uint32_t bench_buf[EP_DATA_LEN/4 + 1];
+//-----------------------------------------------------------------------------
+__ramfunc static void __attribute__((noinline)) Read_PMA_ref(uint8_t* dest, uint32_t * src, int count)
+{
+	int i = count/2;
+	while (i--)
+	{
+		UMEM_FAKEWIDTH val = *src++;
+		*dest++ = val;
+		*dest++ = val>>8;
+	}
+}
+//-----------------------------------------------------------------------------
+__ramfunc static void __attribute__((noinline)) Write_PMA_ref(uint32_t* dest, uint8_t * src, int count)
+{
+	int j = count/2;
+	while (j--)
+	{
+		register UMEM_FAKEWIDTH val = *src++;
+		val |= (*src++) << 8;
+		*dest++ = val;
+	}
+}
+//-----------------------------------------------------------------------------
+__ramfunc static void __attribute__((noinline)) Write_PMA(uint32_t* dest, uint8_t * src, int count)
+{
+	int n = count/2;
+	if ( ((uint32_t)src & 3)==0 )
+		Write_PMA32(dest, (uint32_t*)src, n/2);
+	else if ( ((uint32_t)src & 1)==0 )
+		Write_PMA16(dest, (uint16_t*)src, n);
+	else
+		for (int i = 0; i < n; i++)
+			dest[i] = src[2*i] | (src[2*i+1] << 8);
+}
+//-----------------------------------------------------------------------------
+void PmaBench(void)
+{
+	uint32_t * pma = epTableAddr[EP_DATA_TX].txAddr;
+	uint8_t * buf = (uint8_t*)bench_buf;
+	dwt_init();
+
+	uint32_t t = dwt_cycles();
+	uint32_t overhead = dwt_cycles() - t;
+
+	for (int i = 0; i < BENCH_NUM; i++)
+	{
+		uint32_t best = 0xFFFFFFFF;
+		for (int r = 0; r < PMA_BENCH_RUNS; r++)
+		{
+			t = dwt_cycles();
+			switch (i)
+			{
+			case BENCH_RD_REF: Read_PMA_ref(buf, pma, EP_DATA_LEN); break;
+			case BENCH_RD_32: Read_PMA(buf, pma, EP_DATA_LEN); break;
+			case BENCH_RD_16: Read_PMA(buf+2, pma, EP_DATA_LEN); break;
+			case BENCH_RD_8: Read_PMA(buf+1, pma, EP_DATA_LEN); break;
+			case BENCH_WR_REF: Write_PMA_ref(pma, buf, EP_DATA_LEN); break;
+			case BENCH_WR_32: Write_PMA(pma, buf, EP_DATA_LEN); break;
+			case BENCH_WR_16: Write_PMA(pma, buf+2, EP_DATA_LEN); break;
+			case BENCH_WR_8: Write_PMA(pma, buf+1, EP_DATA_LEN); break;
+			}
+			t = dwt_cycles() - t - overhead;
+			if (t<best)
+				best = t;
+		}
+		pma_bench[i] = best;
+		trace("bench "); ntrace(i, 0); trace(": "); ntrace(best, 1);
+	}
+}
+#endif
+
 //-----------------------------------------------------------------------------
 // Control-Transfers block transmission start
 //-----------------------------------------------------------------------------
@@ -599,6 +910,56 @@ voidFuncPtr const reqFunc[] = {
 		NULL,				// USB_REQ_SET_SYNCH_FRAME = 12
 };
 //-----------------------------------------------------------------------------
+#if USB_STATS
+//-----------------------------------------------------------------------------
+// vendor request: snapshot of the runtime counters
+//-----------------------------------------------------------------------------
+static void Vendor_GetStats(void)
+{
+	trace("STATS-");
+	static usb_stats_t snap; // the data stage is sent from it
+	snap = usb_stats;
+	snap.size = sizeof(usb_stats_t);
+#if FLASH_STATS
+	snap.bytes_programmed = flash_stats.programmed * 2;
+	snap.pages_erased = flash_stats.erased;
+	snap.erase_time = flash_stats.erase_cycles / (F_CPU/1000000);
+	snap.program_time = flash_stats.program_cycles / (F_CPU/1000000);
+#endif
+
+	int len = sizeof(usb_stats_t);
+	if (len > CMD.setupPacket.wLength)
+		len = CMD.setupPacket.wLength;
+	CMD.packetLen = EP_DATA_LEN;
+	CMD.transferLen = len;
+	CMD.transferPtr = (uint8_t*) &snap;
+	TransmitSetupPacket();
+}
+#endif
+#if USB_SOF_STATS
+//-----------------------------------------------------------------------------
+// vendor request: snapshot of the bus utilization
+//-----------------------------------------------------------------------------
+static void Vendor_GetFrames(void)
+{
+	trace("FRAMES-");
+	static frame_stats_t snap; // the data stage is sent from it
+	snap = frame_stats;
+	if (CMD.setupPacket.wValue==1)
+	{
+		frame_stats = (frame_stats_t){ 0 };
+		frame.valid = false;
+	}
+	int len = sizeof(frame_stats_t);
+	if (len > CMD.setupPacket.wLength)
+		len = CMD.setupPacket.wLength;
+	CMD.packetLen = EP_DATA_LEN;
+	CMD.transferLen = len;
+	CMD.transferPtr = (uint8_t*) &snap;
+	TransmitSetupPacket();
+}
+#endif
+//-----------------------------------------------------------------------------
 void OnSetup(void)
 {
 	// read the setup packet form CTRL EP buffer
@@ -651,6 +1012,24 @@ void OnSetup(void)
 		ACK();
 		return;
 	}
+	else if (IsVendorRequest()) // Type = Vendor
+	{
+		trace("VENDOR-");
+#if USB_STATS
+		if ( CMD.setupPacket.bRequest==VENDOR_REQ_STATS && (CMD.setupPacket.bmRequestType & USB_REQ_TYPE_IN) )
+		{
+			Vendor_GetStats();
+			return;
+		}
+#endif
+#if USB_SOF_STATS
+		if ( CMD.setupPacket.bRequest==VENDOR_REQ_FRAMES && (CMD.setupPacket.bmRequestType & USB_REQ_TYPE_IN) )
+		{
+			Vendor_GetFrames();
+			return;
+		}
+#endif
+	}
 	trace("REQ_?!?-");
 
 	// if request not recognized then send NAK
@@ -714,135 +1093,1686 @@ void OnEpCtrlIn(void) // Control-EP IN
 	{
 		trace("CLASS-");
 	}
+	else if (IsVendorRequest()) // reqType = Vendor
+	{
+		trace("VENDOR-");
+		if (CMD.transferLen > 0) // the statistics blocks can be longer than a packet
+		{
+			trace("(cont)-");
+			TransmitSetupPacket();
+			return;
+		}
+	}
 	else { trace("?!?-"); }
 	//ACK(); // not necessary, is just for us to know that packet has been sent.
 	trace("Done\n");
 }
 
+#if FLASH_DUMP
+//-----------------------------------------------------------------------------
+// flash dump state
+uint32_t dump_addr, dump_remaining;
+volatile bool dump_active;
+//-----------------------------------------------------------------------------
+// Send the next packet of a flash dump directly from flash into PMA.
+// A short packet ends the transfer, after a full last packet a ZLP follows.
+//-----------------------------------------------------------------------------
+static inline void SendDump(void)
+{
+	int n = (dump_remaining>EP_DATA_LEN) ? EP_DATA_LEN : dump_remaining;
+	SendData(EP_DATA_TX, (uint8_t*)dump_addr, n);
+	dump_addr += n;
+	dump_remaining -= n;
+	if (n<EP_DATA_LEN)
+		dump_active = false;
+}
+#endif
+//-----------------------------------------------------------------------------
+volatile int tx_hold; // an OUT packet is held in PMA until the ring has TX_REPLY_MAX room
+#if TX_RING
+//-----------------------------------------------------------------------------
+// EP_DATA IN transmit engine. Producers append their data to tx_ring by
+// TxWrite(), OnEpBulkIn() sends it packet by packet. When the ring runs empty
+// after a full packet, a ZLP terminates the transfer.
+//-----------------------------------------------------------------------------
+uint8_t tx_ring[TX_RING_LEN];
+volatile uint16_t tx_head, tx_tail; // written / sent bytes
+volatile bool tx_busy; // a packet is in PMA, OnEpBulkIn() follows
+bool tx_zlp; // the last packet was full
+//-----------------------------------------------------------------------------
+static inline int TxCount(void)
+{
+	return (uint16_t)(tx_head - tx_tail);
+}
+//-----------------------------------------------------------------------------
+int TxFree(void)
+{
+	return TX_RING_LEN - TxCount();
+}
+//-----------------------------------------------------------------------------
+// true when everything was sent and collected by the host
+//-----------------------------------------------------------------------------
+bool TxIdle(void)
+{
+#if FLASH_DUMP
+	if (dump_active)
+		return false;
+#endif
+	return ( !tx_busy && TxCount()==0 );
+}
+//-----------------------------------------------------------------------------
+void TxReset(void)
+{
+	tx_head = tx_tail = 0;
+	tx_busy = false;
+	tx_zlp = false;
+	tx_hold = 0;
+#if FLASH_DUMP
+	dump_active = false;
+#endif
+}
+//-----------------------------------------------------------------------------
+// Load the next packet into PMA. Called by the ISR or with interrupts disabled.
+//-----------------------------------------------------------------------------
+__ramfunc static void TxNext(void)
+{
+	int n = TxCount();
+	tx_busy = true;
+	if (n)
+	{
+		uint8_t pkt[EP_DATA_LEN];
+		if (n>EP_DATA_LEN)
+			n = EP_DATA_LEN;
+		for (int i = 0; i < n; i++)
+			pkt[i] = tx_ring[(tx_tail + i) & (TX_RING_LEN-1)];
+		SendData(EP_DATA_TX, pkt, n);
+		tx_tail += n;
+		tx_zlp = (n==EP_DATA_LEN);
+	}
+	else if (tx_zlp)
+	{
+		SendData(EP_DATA_TX, NULL, 0);
+		tx_zlp = false;
+	}
+#if FLASH_DUMP
+	else if (dump_active)
+	{
+		SendDump();
+	}
+#endif
+	else
+	{
+		tx_busy = false;
+	}
+}
+//-----------------------------------------------------------------------------
+// Queue data for EP_DATA IN. All or nothing, false if the ring has no room,
+// the producer has to retry later.
+//-----------------------------------------------------------------------------
+__ramfunc bool TxWrite(const void * data, int len)
+{
+	bool ok = false;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if ( len<=TxFree() )
+		{
+			const uint8_t * src = data;
+			for (int i = 0; i < len; i++)
+				tx_ring[(tx_head + i) & (TX_RING_LEN-1)] = src[i];
+			tx_head += len;
+			if (!tx_busy)
+				TxNext();
+			ok = true;
+		}
+	}
+	return ok;
+}
+__ramfunc void OnEpBulkOut(void);
 //-----------------------------------------------------------------------------
 // manage data to be transmitted to host via EP_DATA IN
 //-----------------------------------------------------------------------------
-void OnEpBulkIn(void)
+__ramfunc void OnEpBulkIn(void)
+{
+	TxNext(); // keep the endpoint fed right after each collected packet
+	trace("done\n");
+	if ( tx_hold && TxFree()>=TX_REPLY_MAX )
+	{	// the held OUT packet can be answered now
+		tx_hold = 0;
+		OnEpBulkOut();
+	}
+}
+#else
+//-----------------------------------------------------------------------------
+// v1 only: the answer is sent straight from the caller
+//-----------------------------------------------------------------------------
+__ramfunc bool TxWrite(const void * data, int len)
+{
+	SendData(EP_DATA_TX, (uint8_t*)data, len);
+	return true;
+}
+//-----------------------------------------------------------------------------
+__ramfunc void OnEpBulkIn(void)
 {
-//	SendData(EP_DATA, (uint8*)&ZERO, 0);
 	trace("done\n");
 }
+#endif
 //-----------------------------------------------------------------------------
 // Read received bytes and write them directly into the ring buffer
 // This need special handling due to the "ring" characteristic,
 // to safeguard the write pointer against going out of boundary
 //-----------------------------------------------------------------------------
-void SendError(error_t err)
+__ramfunc void SendError(error_t err)
 {
+#if USB_STATS
+	if (err<ERROR_NUM)
+		usb_stats.errors[err]++;
+#endif
+	EVT(EVT_ERROR, err, 0);
 	trace("ERR:"); ntrace(err, 0); trace("-");
-	SendData(EP_DATA, &err, sizeof(error_t));
+	TxWrite(&err, sizeof(error_t));
 	trace("\n");
 }
 
 //-----------------------------------------------------------------------------
-uint8_t rx_buf[EP_DATA_LEN];
+// Flash pages staged by the ISR and written by ProcessRxQueue() from yield()
+//-----------------------------------------------------------------------------
+page_buf_t rx_pages[RX_QUEUE_LEN];
+queue_t rx_queue = QUEUE_INIT(RX_QUEUE_LEN);
+page_buf_t * volatile rx_stage; // the page currently filled by the ISR, not yet queued
+volatile int rx_pending; // a packet is held in PMA because the queue was full
+#if EP_DATA_DBL_BUF
+volatile int rx_skipped; // the other Rx buffer was filled while a packet was held
+#endif
 int num_pages; // number of total pages to flash
 int crt_page; // currently flashed pages
 int page_offset, page_len, header_ok;
 cmd_t _cmd;
+#if UPLOAD_V2
+// protocol v2: streaming session
+session_t session; // session.len is not 0 while a session is running
+uint32_t rx_addr; // flash address of the next received byte
+volatile uint32_t rx_remaining; // number of image bytes still to be received
+int pages_written; // number of flash pages written in this session
+int pages_skipped; // number of unchanged flash pages not rewritten in this session
+bool page_skipped; // the last processed page was not rewritten
+bool session_done; // the complete image was written and verified
+report_t report;
+volatile int report_pending;
+// v2 windowed: frames with sequence numbers
+frame_t _frame;
+uint16_t num_frames; // number of flash pages of the image
+uint16_t frame_seq; // page of the frame being received
+uint16_t frame_remaining; // data bytes of the current frame still to receive, 0: wait for frame header
+bool frame_skip; // the data of the current frame is discarded
+bool sparse_end; // sparse: the host sent all changed pages
+volatile uint16_t ack_base; // all pages below were written
+uint32_t page_map[(FLASH_PAGES_MAX+31)/32]; // written pages of the image
+// protocol v2: stream with page CRC
+uint8_t ck_in[EP_DATA_LEN]; // the held packet
+uint8_t ck_pos, ck_len; // next byte to process, number of bytes, 0: no packet held
+uint8_t ck_trailer; // CRC bytes of the staged page received
+#if UPLOAD_DIRECT
+// v2 direct: the packet held in PMA for ProcessDirect()
+enum { DIRECT_IDLE, DIRECT_PENDING, DIRECT_DONE };
+volatile uint8_t direct_state;
+uint16_t direct_len;
+error_t direct_err;
+#endif
+bool session_hold; // a session header waits until the flash is idle
+#if UPLOAD_LZ
+// v2 compressed: decoder and the packet being decoded
+lz_t lz;
+uint8_t z_in[EP_DATA_LEN];
+int z_pos, z_len;
+bool z_overflow; // the decoded data is longer than the image
+#endif
+#endif // UPLOAD_V2
+#if UPLOAD_MANIFEST
+// page hash manifest
+int mf_page, mf_end; // next and end flash page index after USER_PROGRAM
+volatile bool mf_active;
+#endif
+#if FLASH_TIMING
+// flash timing characterization
+int ft_page, ft_rounds;
+volatile bool ft_request;
+bool ft_ready; // ft_result is waiting for room in the transmit ring
+timing_t ft_result;
+#endif
+#if UPLOAD_STATS
+// statistics of the last v2 session, in DWT cycles
+struct {
+	uint32_t start, nak_start;
+	uint32_t len; // session.len
+	uint32_t time, nak_time, isr_time;
+	uint32_t page_min, page_max, page_sum;
+	uint32_t done_at; // final report queued
+	uint16_t pages;
+	uint8_t err;
+	bool read; // the final values were sent, the application may start
+} stats;
+#define CYCLES_PER_US	(F_CPU/1000000)
+#endif
+//-----------------------------------------------------------------------------
+static inline void StatsStart(void)
+{
+#if UPLOAD_STATS
+	stats.start = dwt_cycles();
+	stats.len = session.len;
+	stats.time = stats.nak_time = stats.isr_time = 0;
+	stats.page_min = 0xFFFFFFFF;
+	stats.page_max = stats.page_sum = 0;
+	stats.pages = 0;
+	stats.err = 0xFF;
+	stats.read = false;
+#endif
+}
+//-----------------------------------------------------------------------------
+// the session ended, freeze the statistics
+//-----------------------------------------------------------------------------
+static inline void StatsDone(error_t err)
+{
+#if UPLOAD_STATS
+	if (stats.err==0xFF)
+	{
+		stats.done_at = dwt_cycles();
+		stats.time = stats.done_at - stats.start;
+		stats.err = err;
+	}
+#else
+	(void)err;
+#endif
+}
+//-----------------------------------------------------------------------------
+// a packet is held in PMA (pending) or it was read (!pending)
+//-----------------------------------------------------------------------------
+static inline void StatsNak(bool pending)
+{
+#if UPLOAD_STATS
+	if (pending)
+		stats.nak_start = dwt_cycles();
+	else if (session.len)
+		stats.nak_time += dwt_cycles() - stats.nak_start;
+#else
+	(void)pending;
+#endif
+}
+//-----------------------------------------------------------------------------
+static inline void StatsPage(page_buf_t * page)
+{
+#if UPLOAD_STATS
+	if (session.len)
+	{
+		uint32_t t = dwt_cycles() - page->queued;
+		if (t<stats.page_min)
+			stats.page_min = t;
+		if (t>stats.page_max)
+			stats.page_max = t;
+		stats.page_sum += t;
+		++stats.pages;
+	}
+#else
+	(void)page;
+#endif
+}
 //-----------------------------------------------------------------------------
-error_t CheckHeader(uint16 rxd, uint8 _id)
+__ramfunc error_t CheckHeader(uint8_t * hdr, uint16 len, uint16 rxd, uint8 _id)
 {
 	// data should be command, plausibility check
-	if (rxd!=sizeof(cmd_t))
+	if (rxd!=len)
 	{
 		trace("~NO_LEN~");
 		return CMD_WRONG_LENGTH;
 	}
 	// read header
-	ReadData(EP_DATA, _cmd.data, rxd);
-	// check crc
-	if ( Check_CRC(_cmd.data, sizeof(cmd_t))==0 )
+	ReadData(EP_DATA, hdr, rxd);
+	// check crc, v1 commands use the additive checksum, v2 headers the lower half of the CRC-32
+#if UPLOAD_V2
+	int crc_ok = (len==sizeof(cmd_t)) ? Check_CRC(hdr, len) :
+				 ( (uint16_t)crc_calc_sw(hdr, len-2)==(hdr[len-2] | (hdr[len-1]<<8)) );
+#else
+	int crc_ok = Check_CRC(hdr, len);
+#endif
+	if ( !crc_ok )
 	{
 		trace("~NO_CRC~");
 		return CMD_WRONG_CRC;
 	}
 	// valid command received. check for id
-	if (_cmd.id!=_id)
+	if (hdr[2]!=_id)
 	{
 		trace("~NO_ID~");
 		return CMD_WRONG_ID;
 	}
-	// echo back the header
-	SendData(EP_DATA, _cmd.data, sizeof(cmd_t));
 	return NO_ERROR;
 }
 
+#if UPLOAD_V2
 //-----------------------------------------------------------------------------
-void OnEpBulkOut(void)
+static inline bool PageWritten(int seq)
 {
-	error_t err = NO_ERROR;
-	// read number of available bytes
-	uint16_t rxd = EpTable[EP_DATA].rxCount & 0x3FF;
-
-	if (num_pages==0)
-	{	// check for header to set number of pages
-		err = CheckHeader(rxd, 0x20);
-		if ( err==NO_ERROR )
-		{
-			num_pages = _cmd.page; // this will be used to detect flash_complete
-		}
-	}
-	else if (header_ok==0)
-	{	// check for data header
-		err = CheckHeader(rxd, 0x21);
-		if ( err==NO_ERROR )
-		{ // prepare data stage
-			TIME_STAMP
-			page_offset = 0;
-			header_ok = 1;
-			page_len = _cmd.data_len;
-			MarkBufferRxDone(EP_DATA); // release data EP Rx for next OUT packet
-			// erase the corresponding page
-			LED_ON;
-			flash_erase_page( (uint16_t*) ( USER_PROGRAM + (crt_page * PAGE_SIZE) ));
-			LED_OFF;
-			return;
-		}
-	}
-	else if (page_len>0)
-	{	// data stage. store data packet into buffer
-		ReadData(EP_DATA, rx_buf, rxd);
-		// flash the data from buffer
-		flash_write_data( (uint16_t*) ( USER_PROGRAM + (crt_page * PAGE_SIZE) + page_offset), (uint16_t*)rx_buf, (rxd+1)>>1);
-		// update page index
-		page_offset += rxd;
-		// check if buffer full
-		if (page_offset>=page_len)
-		{	// it was the last data packet from the current page. prepare header stage
-			++crt_page;
-			header_ok = 0;
-			page_len = 0;
-		}
-	}
-
-	if (err)
-		SendError(err);
-
-	MarkBufferRxDone(EP_DATA); // release data EP Rx for next OUT packet
-
+	return ( page_map[seq>>5] & (1UL<<(seq & 31)) ) != 0;
 }
 //-----------------------------------------------------------------------------
-//--------------- USB-Interrupt-Handler ---------------------------------------
+// selective acknowledge of the pages above ack_base
 //-----------------------------------------------------------------------------
-void NAME_OF_USB_IRQ_HANDLER(void)
+__ramfunc static uint32_t AckBitmap(void)
 {
-    uint32_t irqStatus = USB_ISTR; // Interrupt-Status
-
-	if (irqStatus & WKUP) // Suspend-->Resume
+	uint32_t bitmap = 0;
+	for (int n = 0; n < 32; n++)
 	{
-		trace("WKUP\n");
-		USB_CNTR &= ~(FSUSP | LP_MODE);
-		usb_state.suspended = false;
+		int seq = ack_base + 1 + n;
+		if ( seq<num_frames && PageWritten(seq) )
+			bitmap |= (1UL<<n);
 	}
-	else if (irqStatus & SUSP) // after 3 ms break -->Suspend
-	{
-		trace("SUSP\n");
+	return bitmap;
+}
+//-----------------------------------------------------------------------------
+// Send the pending v2 report if the transmit ring has room.
+// Called from yield() to retry, and right after a new report was set up.
+//-----------------------------------------------------------------------------
+__ramfunc void FlushReport(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if ( report_pending && TxWrite(report.data, sizeof(report_t)) )
+			report_pending = 0;
+	}
+}
+//-----------------------------------------------------------------------------
+// Asynchronous status report of the v2 protocol.
+// A pending final, error or NAK report is never replaced by a progress or ACK report.
+// 'seq' is the processed page for a PROGRESS and the rejected page for a NAK report,
+// 'offset' the position of a verify error.
+//-----------------------------------------------------------------------------
+__ramfunc static void SendPageReport(uint8_t id, error_t err, uint16_t seq, uint32_t offset)
+{
+	trace("REP:"); ntrace(err, 0); trace("-");
+#if USB_STATS
+	if (err && err<ERROR_NUM)
+		usb_stats.errors[err]++;
+#endif
+	EVT(EVT_REPORT, id, err);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		bool progress = (id==CMD_ID_PROGRESS || id==CMD_ID_ACK);
+		bool keep = (report.id==CMD_ID_DONE || report.id==CMD_ID_NAK || report.err!=NO_ERROR);
+		if ( !(report_pending && progress && keep) )
+		{
+			report.start = CMD_START;
+			report.id = id;
+			report.err = err;
+			report.pages = pages_written;
+			report.seq = (id==CMD_ID_ACK) ? ack_base : seq;
+			report.bitmap = (id==CMD_ID_ACK) ? AckBitmap() : offset;
+			report.window = UPLOAD_WINDOW;
+			report.flags = (progress && page_skipped) ? REPORT_SKIPPED : 0;
+			report.skipped = pages_skipped;
+			report.crc = crc_calc_sw(report.data, sizeof(report_t)-2);
+			report_pending = 1;
+			if (id==CMD_ID_DONE)
+				StatsDone(err);
+		}
+	}
+	FlushReport();
+}
+//-----------------------------------------------------------------------------
+__ramfunc void SendReport(uint8_t id, error_t err, uint16_t seq)
+{
+	SendPageReport(id, err, seq, 0);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Open a staging buffer for the flash page at the given address
+//-----------------------------------------------------------------------------
+__ramfunc static void OpenStage(uint32_t addr)
+{
+	rx_stage = &rx_pages[queue_wr_slot(&rx_queue)];
+	rx_stage->addr = addr;
+	rx_stage->len = 0;
+	// any gap not sent by the host stays erased
+	uint32_t * p = (uint32_t*)rx_stage->data;
+	for (int i = 0; i < flash_page_size/4; i++)
+		*p++ = 0xFFFFFFFF;
+}
+//-----------------------------------------------------------------------------
+// Hand the staging buffer over to ProcessRxQueue()
+//-----------------------------------------------------------------------------
+__ramfunc static void CommitStage(void)
+{
+#if UPLOAD_STATS
+	rx_stage->queued = dwt_cycles();
+#endif
+	EVT(EVT_PAGE_QUEUED, rx_stage->len, rx_stage->addr);
+	queue_push(&rx_queue);
+	rx_stage = NULL;
+}
+//-----------------------------------------------------------------------------
+// number of staging buffers neither queued nor being filled
+//-----------------------------------------------------------------------------
+static inline int FreeStages(void)
+{
+	return RX_QUEUE_LEN - queue_count(&rx_queue) - (rx_stage ? 1 : 0);
+}
+
+#if UPLOAD_V2
+#if FLASH_DUMP
+//-----------------------------------------------------------------------------
+// Flash dump request. The header is echoed, then the flash range follows
+// packet by packet from OnEpBulkIn().
+//-----------------------------------------------------------------------------
+static error_t StartDump(void)
+{
+	uint32_t addr = session.addr, len = session.len;
+	session.len = 0; // no upload session
+	if ( len==0 || addr<FLASH_BASE || addr>=FLASH_END || len>(FLASH_END - addr) )
+		return CMD_WRONG_ADDRESS;
+
+	dump_addr = addr;
+	dump_remaining = len;
+	TxWrite(session.data, sizeof(session_t));
+	dump_active = true; // follows the echo
+	return NO_ERROR;
+}
+#endif
+//-----------------------------------------------------------------------------
+// v2: check the session header and prepare the data stream
+//-----------------------------------------------------------------------------
+static error_t StartSession(uint16 rxd)
+{
+	error_t err = CheckHeader(session.data, sizeof(session_t), rxd, CMD_ID_SESSION);
+#if FLASH_DUMP
+	if ( err==CMD_WRONG_ID && session.id==CMD_ID_DUMP )
+		return StartDump(); // same layout, not an upload session
+#endif
+	if ( err==NO_ERROR )
+	{
+		if ( session.len==0 || (session.addr & (flash_page_size-1)) ||
+			 session.addr<USER_PROGRAM || session.addr>=FLASH_END || session.len>(FLASH_END - session.addr) )
+			err = CMD_WRONG_ADDRESS;
+	}
+	if (err)
+	{
+		session.len = 0; // no session
+		return err;
+	}
+	if ( (session.flags & ~SESSION_SUPPORTED) ||
+		 ((session.flags & SESSION_COMPRESSED) && (session.flags & SESSION_WINDOWED)) ||
+		 ((session.flags & SESSION_SPARSE) && !(session.flags & SESSION_WINDOWED)) ||
+		 ((session.flags & SESSION_PAGE_CRC) && (session.flags & (SESSION_WINDOWED | SESSION_COMPRESSED))) ||
+		 ((session.flags & SESSION_DIRECT) && (session.flags & ~(SESSION_DIRECT | SESSION_VERIFY))) )
+	{	// tell the host what this device supports, no session
+		session.flags = SESSION_SUPPORTED;
+		session.crc = crc_calc_sw(session.data, sizeof(session_t)-2);
+		TxWrite(session.data, sizeof(session_t));
+		session.len = 0;
+		return NO_ERROR;
+	}
+	rx_addr = session.addr;
+	rx_remaining = session.len;
+	pages_written = 0;
+	pages_skipped = 0;
+	num_frames = (session.len + flash_page_size - 1) / flash_page_size;
+	frame_remaining = 0;
+	ack_base = 0;
+	sparse_end = false;
+	ck_len = 0;
+	for (int i = 0; i < (FLASH_PAGES_MAX+31)/32; i++)
+		page_map[i] = 0;
+#if UPLOAD_LZ
+	lz_init(&lz);
+	z_len = 0;
+	z_overflow = false;
+#endif
+	StatsStart();
+	// echo back the header, the data stream may follow right away
+	TxWrite(session.data, sizeof(session_t));
+	return NO_ERROR;
+}
+//-----------------------------------------------------------------------------
+// v2: store a packet of the data stream into the staging buffers
+//-----------------------------------------------------------------------------
+__ramfunc static error_t ReceiveStream(uint16 rxd)
+{
+	if (rxd>rx_remaining)
+		return DATA_OVERFLOW;
+
+	int offset = rx_stage ? (rx_addr - rx_stage->addr) : 0;
+	int crossing = rx_stage && ((offset + rxd) > flash_page_size);
+	// a new staging buffer is needed for the first byte of a flash page
+	int needed = (rx_stage==NULL || crossing) ? 1 : 0;
+	if ( FreeStages() < needed )
+		return NO_FREE_BUFFER;
+
+	if (rx_stage==NULL)
+		OpenStage(rx_addr);
+
+	if ( !crossing )
+	{
+		ReadData(EP_DATA, rx_stage->data + offset, rxd);
+	}
+	else
+	{	// the packet continues on the next flash page
+		uint8_t buf[EP_DATA_LEN];
+		ReadData(EP_DATA, buf, rxd);
+		int n = flash_page_size - offset;
+		for (int i = 0; i < n; i++)
+			rx_stage->data[offset + i] = buf[i];
+		rx_stage->len = flash_page_size;
+		CommitStage();
+		OpenStage(rx_addr + n);
+		for (int i = n; i < rxd; i++)
+			rx_stage->data[i - n] = buf[i];
+	}
+	rx_addr += rxd;
+	rx_remaining -= rxd;
+	rx_stage->len = rx_addr - rx_stage->addr;
+	// the flash page is complete or it was the last data of the image
+	if ( rx_stage->len>=flash_page_size || rx_remaining==0 )
+		CommitStage();
+
+	return NO_ERROR;
+}
+
+#if UPLOAD_DIRECT
+//-----------------------------------------------------------------------------
+// v2 direct: the packet is held in PMA, ProcessDirect() programs it from
+// yield() and calls OnEpBulkOut() again to release it.
+// Only the last packet of the image may have an odd length.
+//-----------------------------------------------------------------------------
+__ramfunc static error_t ReceiveDirect(uint16 rxd)
+{
+	if (direct_state==DIRECT_DONE)
+	{
+		direct_state = DIRECT_IDLE;
+		return direct_err;
+	}
+	if (rxd>rx_remaining)
+		return DATA_OVERFLOW;
+	if ( (rxd & 1) && rxd!=rx_remaining )
+		return DATA_WRONG_FORMAT;
+
+	direct_len = rxd;
+	direct_state = DIRECT_PENDING;
+	return NO_FREE_BUFFER; // hold the packet
+}
+//-----------------------------------------------------------------------------
+// v2 direct: program the held packet straight from PMA into flash, without
+// staging. A flash page is erased when its first byte arrives. The last byte
+// of an odd length packet is padded with 0xFF.
+//-----------------------------------------------------------------------------
+static error_t WriteDirect(uint16 rxd)
+{
+	const uint32_t * src = GetRxBuf(EP_DATA);
+	while (rxd)
+	{
+		uint32_t page_addr = rx_addr & ~(flash_page_size-1);
+		int n = page_addr + flash_page_size - rx_addr;
+		if (n>rxd)
+			n = rxd;
+		if (rx_addr==page_addr)
+		{
+			LED_ON;
+			EVT(EVT_FLASH_ERASE, 0, page_addr);
+			uint32 errors = flash_erase_page((uint16_t*)page_addr);
+			LED_OFF;
+			if (errors)
+				return FLASH_PROGRAM_ERROR;
+		}
+		uint16_t * dest = (uint16_t*)rx_addr;
+		EVT(EVT_FLASH_PROGRAM, n/2, rx_addr);
+		if ( flash_write_pma(dest, src, n/2) )
+			return FLASH_PROGRAM_ERROR;
+		if (n&1)
+		{
+			uint16_t tail = (uint16_t)src[n/2] | 0xFF00;
+			if ( flash_write_data(dest + n/2, &tail, 1) )
+				return FLASH_PROGRAM_ERROR;
+		}
+		if (session.flags & SESSION_VERIFY)
+		{
+			for (int i = 0; i < (n+1)/2; i++)
+			{
+				uint16_t val = (uint16_t)src[i];
+				if ( (n&1) && i==n/2 )
+					val |= 0xFF00;
+				if ( dest[i]!=val )
+					return FLASH_VERIFY_ERROR;
+			}
+		}
+		src += n/2;
+		rx_addr += n;
+		rx_remaining -= n;
+		rxd -= n;
+		if ( rx_addr==(page_addr + flash_page_size) || rx_remaining==0 )
+		{
+			++pages_written;
+			SendReport(CMD_ID_PROGRESS, NO_ERROR, (page_addr - session.addr) / flash_page_size);
+		}
+	}
+	return NO_ERROR;
+}
+//-----------------------------------------------------------------------------
+// v2 direct: program the packet held by ReceiveDirect(), then release it
+//-----------------------------------------------------------------------------
+static void ProcessDirect(void)
+{
+	if (direct_state!=DIRECT_PENDING)
+		return;
+
+	direct_err = WriteDirect(direct_len);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		direct_state = DIRECT_DONE;
+		rx_pending = 0;
+		StatsNak(false);
+		OnEpBulkOut();
+	}
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// v2 stream with page CRC: store a packet into the staging buffers and collect
+// the CRC following the data of each flash page. When no staging buffer is
+// free, the rest of the packet is processed on the next call.
+//-----------------------------------------------------------------------------
+__ramfunc static error_t ReceiveChecked(uint16 rxd)
+{
+	if (ck_len==0)
+	{	// a new packet, else continue with the held one
+		ReadData(EP_DATA, ck_in, rxd);
+		ck_pos = 0;
+		ck_len = rxd;
+	}
+	while (ck_pos<ck_len)
+	{
+		if (rx_stage==NULL)
+		{
+			if (rx_remaining==0)
+				return DATA_OVERFLOW;
+			if ( FreeStages()==0 )
+				return NO_FREE_BUFFER; // keep the packet
+			OpenStage(rx_addr);
+			rx_stage->checksum = 0;
+			ck_trailer = 0;
+		}
+		if ( rx_stage->len<flash_page_size && rx_remaining )
+		{	// page data
+			int n = ck_len - ck_pos;
+			if ( n>(flash_page_size - rx_stage->len) )
+				n = flash_page_size - rx_stage->len;
+			if ( (uint32_t)n>rx_remaining )
+				n = rx_remaining;
+			for (int i = 0; i < n; i++)
+				rx_stage->data[rx_stage->len + i] = ck_in[ck_pos + i];
+			ck_pos += n;
+			rx_addr += n;
+			rx_remaining -= n;
+			rx_stage->len += n;
+		}
+		else
+		{	// the page CRC, the page is queued when it is complete
+			rx_stage->checksum |= (uint32_t)ck_in[ck_pos++] << (8*ck_trailer);
+			if (++ck_trailer==4)
+				CommitStage();
+		}
+	}
+	ck_len = 0;
+	return NO_ERROR;
+}
+#if UPLOAD_LZ
+//-----------------------------------------------------------------------------
+// v2 compressed: store one decoded byte, false if no staging buffer is free
+//-----------------------------------------------------------------------------
+__ramfunc static bool StreamPut(uint8_t b)
+{
+	if (rx_remaining==0)
+	{
+		z_overflow = true;
+		return false;
+	}
+	if (rx_stage==NULL)
+	{
+		if ( FreeStages()==0 )
+			return false;
+		OpenStage(rx_addr);
+	}
+	rx_stage->data[rx_addr - rx_stage->addr] = b;
+	++rx_addr;
+	--rx_remaining;
+	rx_stage->len = rx_addr - rx_stage->addr;
+	// the flash page is complete or it was the last byte of the image
+	if ( rx_stage->len>=flash_page_size || rx_remaining==0 )
+		CommitStage();
+	return true;
+}
+//-----------------------------------------------------------------------------
+// v2 compressed: decode a packet into the staging buffers.
+// When they are full, the rest of the packet is decoded on the next call.
+//-----------------------------------------------------------------------------
+__ramfunc static error_t ReceiveCompressed(uint16 rxd)
+{
+	if (z_len==0)
+	{	// a new packet, else continue with the held one
+		ReadData(EP_DATA, z_in, rxd);
+		z_pos = 0;
+		z_len = rxd;
+	}
+	int n = lz_decode(&lz, z_in + z_pos, z_len - z_pos, StreamPut);
+	if (n<0)
+		return DATA_WRONG_FORMAT;
+	if (z_overflow)
+		return DATA_OVERFLOW;
+	z_pos += n;
+	if ( z_pos<z_len || lz_busy(&lz) )
+		return NO_FREE_BUFFER; // keep the packet
+	z_len = 0;
+	return NO_ERROR;
+}
+#endif
+//-----------------------------------------------------------------------------
+// v2 windowed: number of data bytes of a frame
+//-----------------------------------------------------------------------------
+static inline uint16_t FrameLen(uint16_t seq)
+{
+	uint32_t rest = session.len - (uint32_t)seq * flash_page_size;
+	return (rest<flash_page_size) ? rest : flash_page_size;
+}
+//-----------------------------------------------------------------------------
+// v2 windowed: acknowledge a written page. A sparse session reports each page,
+// the first page not written does not advance there.
+//-----------------------------------------------------------------------------
+__ramfunc static void AckFrame(uint16_t seq)
+{
+	if (session.flags & SESSION_SPARSE)
+		SendReport(CMD_ID_PROGRESS, NO_ERROR, seq);
+	else
+		SendReport(CMD_ID_ACK, NO_ERROR, 0);
+}
+//-----------------------------------------------------------------------------
+// v2 windowed: a valid frame header was read into _frame
+//-----------------------------------------------------------------------------
+__ramfunc static error_t StartFrame(void)
+{
+	if (frame_remaining)
+	{	// the previous frame is incomplete, a data packet was lost
+		SendReport(CMD_ID_NAK, DATA_UNDEFLOW, frame_seq);
+		if (!frame_skip)
+			rx_stage = NULL; // drop the staged data, the buffer is reused
+		frame_remaining = 0;
+	}
+	if (_frame.flags & FRAME_END)
+	{	// the session finishes when the queued pages are written
+		if ( (session.flags & SESSION_SPARSE) && _frame.len==0 )
+			sparse_end = true;
+		else
+			SendReport(CMD_ID_NAK, CMD_WRONG_LENGTH, _frame.seq);
+		return NO_ERROR;
+	}
+	uint16_t seq = _frame.seq;
+	if ( seq>=num_frames || _frame.len!=FrameLen(seq) )
+	{	// the data packets of this frame will be discarded
+		SendReport(CMD_ID_NAK, CMD_WRONG_LENGTH, seq);
+		return NO_ERROR;
+	}
+	frame_skip = PageWritten(seq);
+	if (frame_skip)
+	{	// already written, the host missed the ACK
+		AckFrame(seq);
+	}
+	else if ( !(session.flags & SESSION_SPARSE) && seq>=(ack_base + UPLOAD_WINDOW) )
+	{	// outside of the window
+		SendReport(CMD_ID_NAK, NO_FREE_BUFFER, seq);
+		frame_skip = true;
+	}
+	else
+	{
+		if ( FreeStages()==0 )
+			return NO_FREE_BUFFER; // hold the header until a staging buffer is free
+		OpenStage(session.addr + (uint32_t)seq * flash_page_size);
+		rx_stage->seq = seq;
+		rx_stage->checksum = _frame.checksum;
+	}
+	frame_seq = seq;
+	frame_remaining = _frame.len;
+	return NO_ERROR;
+}
+//-----------------------------------------------------------------------------
+// v2 windowed: store a packet of the frame stream into the staging buffers.
+// Errors are reported by NAK, the session continues.
+//-----------------------------------------------------------------------------
+__ramfunc static error_t ReceiveFrame(uint16 rxd)
+{
+	bool peeked = false;
+	if ( rxd==sizeof(frame_t) )
+	{	// a valid frame header is accepted at any time to resync after a lost packet
+		error_t err = CheckHeader(_frame.data, sizeof(frame_t), rxd, CMD_ID_FRAME);
+		if ( err==NO_ERROR )
+			return StartFrame();
+		if ( frame_remaining==0 )
+		{
+			SendReport(CMD_ID_NAK, err, 0xFFFF);
+			return NO_ERROR;
+		}
+		peeked = true; // it is a data packet, already read into _frame
+	}
+	if ( frame_remaining==0 )
+		return NO_ERROR; // data without valid frame header, discard
+
+	if ( rxd>frame_remaining )
+		rxd = frame_remaining;
+	if ( !frame_skip )
+	{
+		uint8_t * dest = rx_stage->data + rx_stage->len;
+		if (peeked)
+		{
+			for (int i = 0; i < rxd; i++)
+				dest[i] = _frame.data[i];
+		}
+		else
+		{
+			ReadData(EP_DATA, dest, rxd);
+		}
+		rx_stage->len += rxd;
+	}
+	frame_remaining -= rxd;
+	if ( frame_remaining==0 && !frame_skip )
+		CommitStage();
+
+	return NO_ERROR;
+}
+
+//-----------------------------------------------------------------------------
+// Device information query
+//-----------------------------------------------------------------------------
+static error_t SendInfo(void)
+{
+	info_t info;
+	info.start = CMD_START;
+	info.id = CMD_ID_INFO;
+	info.version = 2;
+	info.flash_size = flash_size;
+	info.user_start = USER_PROGRAM;
+	info.page_size = flash_page_size;
+	info.pages = (FLASH_END - USER_PROGRAM) / flash_page_size;
+	info.session_flags = SESSION_SUPPORTED;
+	info.window = UPLOAD_WINDOW;
+	info.crc = crc_calc_sw(info.data, sizeof(info_t)-2);
+	TxWrite(info.data, sizeof(info_t));
+	return NO_ERROR;
+}
+#endif // UPLOAD_V2
+#if UPLOAD_STATS
+//-----------------------------------------------------------------------------
+// statistics of the last v2 session, while it runs the values so far
+//-----------------------------------------------------------------------------
+static error_t SendStats(void)
+{
+	stats_t st;
+	bool running = (stats.err==0xFF);
+	st.start = CMD_START;
+	st.id = CMD_ID_STATS;
+	st.err = stats.err;
+	st.bytes = stats.len - rx_remaining;
+	st.time = (running ? (dwt_cycles() - stats.start) : stats.time) / CYCLES_PER_US;
+	st.nak_time = stats.nak_time / CYCLES_PER_US;
+	st.isr_time = stats.isr_time / CYCLES_PER_US;
+	st.pages = stats.pages;
+	st.page_min = stats.pages ? (stats.page_min / CYCLES_PER_US) : 0;
+	st.page_max = stats.page_max / CYCLES_PER_US;
+	st.page_sum = stats.page_sum / CYCLES_PER_US;
+	st.crc = crc_calc_sw(st.data, sizeof(stats_t)-2);
+	if ( TxWrite(st.data, sizeof(stats_t)) && !running )
+		stats.read = true;
+	return NO_ERROR;
+}
+#endif
+#if PROFILE
+//-----------------------------------------------------------------------------
+// read a profiling probe, optionally clear it
+//-----------------------------------------------------------------------------
+static error_t SendProfile(void)
+{
+	if (_cmd.page>=PROF_NUM)
+		return CMD_WRONG_ADDRESS;
+
+	profile_t pr;
+	prof_t * p = &prof[_cmd.page];
+	pr.start = CMD_START;
+	pr.id = CMD_ID_PROFILE;
+	pr.probe = _cmd.page;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{	// consistent snapshot, the ISRs update the probes
+		pr.min = p->min;
+		pr.max = p->max;
+		pr.sum = p->sum;
+		pr.count = p->count;
+		for (int i = 0; i < PROF_HIST; i++)
+			pr.hist[i] = p->hist[i];
+		if (_cmd.data_len==1)
+			prof_reset(_cmd.page);
+	}
+	pr.crc = crc_calc_sw(pr.data, sizeof(profile_t)-2);
+	TxWrite(pr.data, sizeof(profile_t));
+	return NO_ERROR;
+}
+#endif
+#if EVT_TRACE
+int ev_remaining; // trace records still to send
+#define EV_PER_PACKET	(int)(EP_DATA_LEN/sizeof(evt_t))
+//-----------------------------------------------------------------------------
+// Event trace request. The header is echoed with the number of records in
+// data_len, the records are sent from yield() by ProcessEvents().
+//-----------------------------------------------------------------------------
+static error_t StartEvents(void)
+{
+	ev_remaining = evt_count();
+	_cmd.page = (evt_lost>255) ? 255 : evt_lost;
+	evt_lost = 0;
+	_cmd.data_len = ev_remaining;
+	_cmd.crc = Calculate_CRC(_cmd.data, sizeof(cmd_t)-2);
+	TxWrite(_cmd.data, sizeof(cmd_t));
+	return NO_ERROR;
+}
+#endif
+//-----------------------------------------------------------------------------
+// Queue the next packet of trace records as soon as the transmit ring has room.
+//-----------------------------------------------------------------------------
+void ProcessEvents(void)
+{
+#if EVT_TRACE
+	if ( ev_remaining==0 || TxFree()<EP_DATA_LEN )
+		return;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{	// the ISR may fill the ring meanwhile, a read record can not be put back
+		evt_t buf[EV_PER_PACKET];
+		int n = 0;
+		while ( TxFree()>=(int)((n+1)*sizeof(evt_t)) && ev_remaining && n<EV_PER_PACKET && evt_get(&buf[n]) )
+		{
+			++n;
+			--ev_remaining;
+		}
+		if (n==0)
+			ev_remaining = 0;
+		else
+			TxWrite(buf, n*sizeof(evt_t));
+	}
+#endif
+}
+#if FLASH_TIMING
+//-----------------------------------------------------------------------------
+// The scratch page must not hold application code: it and all pages above it
+// are erased, i.e. it lies after the end of the application. The scan stops
+// at the first programmed word.
+//-----------------------------------------------------------------------------
+static bool ScratchPageFree(int page)
+{
+	const uint32_t * p = (const uint32_t*)(USER_PROGRAM + page * flash_page_size);
+	const uint32_t * end = (const uint32_t*)FLASH_END;
+	while (p<end)
+	{
+		if (*p++!=0xFFFFFFFF)
+			return false;
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------
+// Flash timing request. The measurement blocks for up to ~50 ms per round,
+// so it runs from yield() by ProcessFlashTiming(), which also sends the answer.
+//-----------------------------------------------------------------------------
+static error_t StartFlashTiming(void)
+{
+	int total = (FLASH_END - USER_PROGRAM) / flash_page_size;
+	if ( _cmd.page>=total || _cmd.data_len==0 || _cmd.data_len>FT_ROUNDS_MAX || ft_request || ft_ready )
+		return CMD_WRONG_ADDRESS;
+	if ( !ScratchPageFree(_cmd.page) )
+		return CMD_WRONG_ADDRESS;
+
+	ft_page = _cmd.page;
+	ft_rounds = _cmd.data_len;
+	ft_request = true;
+	return NO_ERROR;
+}
+#endif
+//-----------------------------------------------------------------------------
+// Erase the scratch page and program each of its halfwords, timed with the
+// DWT cycle counter. A halfword is programmed with interrupts disabled, the
+// erase is not, so erase_max may include ISR time. The page is left erased.
+//-----------------------------------------------------------------------------
+void ProcessFlashTiming(void)
+{
+#if FLASH_TIMING
+	if ( ft_ready && TxWrite(ft_result.data, sizeof(timing_t)) )
+		ft_ready = false;
+	if ( !ft_request || !queue_empty(&rx_queue) || rx_stage || flash_busy() )
+		return;
+
+	timing_t tm = { 0 };
+	tm.start = CMD_START;
+	tm.id = CMD_ID_FLASH_TIMING;
+	tm.page = ft_page;
+	tm.erase_min = tm.prog_min = 0xFFFFFFFF;
+	uint16_t * page = (uint16_t*)(USER_PROGRAM + ft_page * flash_page_size);
+	const uint32_t bucket = FT_BUCKET_US * (F_CPU/1000000);
+
+	LED_ON;
+	for (int r = 0; r < ft_rounds && tm.err==NO_ERROR; r++)
+	{
+		uint32_t t = dwt_cycles();
+		uint32 errors = flash_erase_page(page);
+		t = dwt_cycles() - t;
+		if (errors)
+		{
+			tm.err = FLASH_PROGRAM_ERROR;
+			break;
+		}
+		tm.rounds++;
+		if (t<tm.erase_min)
+			tm.erase_min = t;
+		if (t>tm.erase_max)
+			tm.erase_max = t;
+		tm.erase_sum += t;
+
+		for (int i = 0; i < flash_page_size/2; i++)
+		{
+			uint16_t val = 0xA55A ^ i; // never 0xFFFF, which would not be programmed
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				t = dwt_cycles();
+				errors = flash_write_data(page + i, &val, 1);
+				t = dwt_cycles() - t;
+			}
+			if (errors)
+			{
+				tm.err = FLASH_PROGRAM_ERROR;
+				break;
+			}
+			if (t<tm.prog_min)
+				tm.prog_min = t;
+			if (t>tm.prog_max)
+				tm.prog_max = t;
+			tm.prog_sum += t;
+			tm.prog_count++;
+			uint32_t b = t / bucket;
+			if (b>=FT_HIST)
+				b = FT_HIST-1;
+			if (tm.prog_hist[b]<0xFFFF)
+				tm.prog_hist[b]++;
+		}
+	}
+	if ( flash_erase_page(page) && tm.err==NO_ERROR )
+		tm.err = FLASH_PROGRAM_ERROR;
+	LED_OFF;
+
+	if (tm.rounds==0)
+		tm.erase_min = 0;
+	if (tm.prog_count==0)
+		tm.prog_min = 0;
+	tm.crc = crc_calc_sw(tm.data, sizeof(timing_t)-2);
+	ft_result = tm;
+	ft_ready = !TxWrite(ft_result.data, sizeof(timing_t));
+	ft_request = false;
+#endif
+}
+#if UPLOAD_MANIFEST
+//-----------------------------------------------------------------------------
+// Page hash query. The header is echoed with the number of hashes in data_len,
+// the hashes are sent from yield() by ProcessManifest().
+//-----------------------------------------------------------------------------
+static error_t StartManifest(void)
+{
+	int total = (FLASH_END - USER_PROGRAM) / flash_page_size;
+	int count = _cmd.data_len ? _cmd.data_len : (total - _cmd.page);
+	if ( count<=0 || (_cmd.page + count)>total )
+		return CMD_WRONG_ADDRESS;
+
+	mf_page = _cmd.page;
+	mf_end = _cmd.page + count;
+	mf_active = true;
+	_cmd.data_len = count;
+	_cmd.crc = Calculate_CRC(_cmd.data, sizeof(cmd_t)-2);
+	TxWrite(_cmd.data, sizeof(cmd_t));
+	return NO_ERROR;
+}
+#endif
+//-----------------------------------------------------------------------------
+// Queue the next packet of page hashes (uint32_t CRC-32, little endian),
+// as soon as the transmit ring has room. The hashing runs outside of the ISR.
+//-----------------------------------------------------------------------------
+void ProcessManifest(void)
+{
+#if UPLOAD_MANIFEST
+	if ( !mf_active || TxFree()<EP_DATA_LEN )
+		return;
+
+	uint32_t hash[EP_DATA_LEN/4];
+	int n = 0;
+	while ( (mf_page + n)<mf_end && n<(EP_DATA_LEN/4) )
+	{
+		hash[n] = crc_calc((uint8_t*)(USER_PROGRAM + (mf_page + n) * flash_page_size), flash_page_size);
+		++n;
+	}
+	if ( !TxWrite(hash, n*4) )
+		return; // the ISR filled the ring meanwhile, hash these pages again
+	mf_page += n;
+	if (mf_page>=mf_end)
+		mf_active = false;
+#endif
+}
+//-----------------------------------------------------------------------------
+// A valid cmd_t other than the v1 header: a query of an enabled feature
+//-----------------------------------------------------------------------------
+static error_t StartQuery(void)
+{
+	switch (_cmd.id)
+	{
+#if UPLOAD_V2
+	case CMD_ID_INFO:
+		return SendInfo();
+#endif
+#if UPLOAD_MANIFEST
+	case CMD_ID_MANIFEST:
+		return StartManifest();
+#endif
+#if UPLOAD_STATS
+	case CMD_ID_STATS:
+		return SendStats();
+#endif
+#if PROFILE
+	case CMD_ID_PROFILE:
+		return SendProfile();
+#endif
+#if EVT_TRACE
+	case CMD_ID_EVENTS:
+		return StartEvents();
+#endif
+#if FLASH_TIMING
+	case CMD_ID_FLASH_TIMING:
+		return StartFlashTiming();
+#endif
+	default:
+		return CMD_WRONG_ID;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Only capture the received data here. The data is collected page-wise,
+// the flash is erased and programmed later by ProcessRxQueue(),
+// so that the USB stays responsive.
+//-----------------------------------------------------------------------------
+__ramfunc void OnEpBulkOut(void)
+{
+#if TX_RING
+	if ( TxFree()<TX_REPLY_MAX )
+	{	// keep EP NAKing, OnEpBulkIn() processes the packet when the host has read
+		tx_hold = 1;
+		return;
+	}
+#endif
+	error_t err = NO_ERROR;
+	// read number of available bytes
+	uint16_t rxd = GetRxCount(EP_DATA);
+
+#if UPLOAD_V2
+	if (session.len)
+	{	// v2: data stream
+		if (session.flags & SESSION_WINDOWED)
+			err = ReceiveFrame(rxd);
+#if UPLOAD_LZ
+		else if (session.flags & SESSION_COMPRESSED)
+			err = ReceiveCompressed(rxd);
+#endif
+#if UPLOAD_DIRECT
+		else if (session.flags & SESSION_DIRECT)
+			err = ReceiveDirect(rxd);
+#endif
+		else if (session.flags & SESSION_PAGE_CRC)
+			err = ReceiveChecked(rxd);
+		else
+			err = ReceiveStream(rxd);
+		if (err==NO_FREE_BUFFER)
+		{
+			rx_pending = 1; // keep EP NAKing, ProcessRxQueue() will read the packet later
+			StatsNak(true);
+			EVT(EVT_NAK, 0, rx_remaining);
+			return;
+		}
+		if (err)
+		{	// abort the session, the host has to start a new one
+			session.len = 0;
+			rx_stage = NULL;
+			SendReport(CMD_ID_DONE, err, 0);
+			err = NO_ERROR;
+		}
+	}
+	else
+#endif
+	if (num_pages==0)
+	{	// check for v2 session header or for v1 header to set number of pages
+#if UPLOAD_V2
+		if (rxd==sizeof(session_t))
+		{
+			if ( !queue_empty(&rx_queue) || flash_busy() )
+			{	// pages of an aborted upload are still written, ProcessRxQueue() starts the session later
+				session_hold = true;
+				rx_pending = 1;
+				return;
+			}
+			err = StartSession(rxd);
+		}
+		else
+#endif
+		{
+			err = CheckHeader(_cmd.data, sizeof(cmd_t), rxd, CMD_ID_NUM_PAGES);
+			if ( err==CMD_WRONG_ID )
+				err = StartQuery();
+			else if ( err==NO_ERROR && _cmd.page>(FLASH_END - USER_PROGRAM) / PAGE_SIZE )
+				err = CMD_WRONG_ADDRESS; // the image does not fit into the flash
+			else if ( err==NO_ERROR )
+			{
+				num_pages = _cmd.page; // this will be used to detect flash_complete
+				TxWrite(_cmd.data, sizeof(cmd_t)); // echo back the header
+			}
+		}
+	}
+	else if (header_ok==0)
+	{
+		uint32_t page_addr = (USER_PROGRAM + (crt_page * PAGE_SIZE)) & ~(flash_page_size-1);
+		if ( rx_stage && rx_stage->addr!=page_addr )
+			CommitStage(); // the new page belongs to another flash page
+
+		if ( rx_stage==NULL && queue_full(&rx_queue) )
+		{
+			rx_pending = 1; // keep EP NAKing, ProcessRxQueue() will read the packet later
+			StatsNak(true);
+			EVT(EVT_NAK, 0, 0);
+			return;
+		}
+		// check for data header
+		err = CheckHeader(_cmd.data, sizeof(cmd_t), rxd, CMD_ID_PAGE);
+		if ( err==NO_ERROR && _cmd.data_len>PAGE_SIZE )
+			err = DATA_OVERFLOW;
+		if ( err==NO_ERROR )
+		{ // prepare data stage
+			TIME_STAMP
+			TxWrite(_cmd.data, sizeof(cmd_t)); // echo back the header
+			page_offset = 0;
+			header_ok = 1;
+			page_len = _cmd.data_len;
+			if (rx_stage==NULL)
+				OpenStage(page_addr);
+		}
+	}
+	else if (page_len>0)
+	{	// data stage. store data packet into the staging buffer
+		int offset = USER_PROGRAM + (crt_page * PAGE_SIZE) + page_offset - rx_stage->addr;
+		if ( rxd > (page_len - page_offset) )
+			rxd = page_len - page_offset;
+		ReadData(EP_DATA, rx_stage->data + offset, rxd);
+		if ( rx_stage->len < (offset + rxd) )
+			rx_stage->len = offset + rxd;
+		// update page index
+		page_offset += rxd;
+		// check if buffer full
+		if (page_offset>=page_len)
+		{	// it was the last data packet from the current page. prepare header stage
+			++crt_page;
+			header_ok = 0;
+			page_len = 0;
+			// the flash page is complete or it was the last page
+			if ( rx_stage->len>=flash_page_size || crt_page==num_pages )
+				CommitStage();
+		}
+	}
+
+	if (err)
+		SendError(err);
+
+	ReleaseDataRx(); // release data EP Rx for next OUT packet
+#if EP_DATA_DBL_BUF
+	if (rx_skipped)
+	{	// the other buffer was filled meanwhile, its CTR was already served by the IRQ handler
+		rx_skipped = 0;
+		TakeDataRx();
+		OnEpBulkOut();
+	}
+#endif
+}
+#if UPLOAD_V2
+//-----------------------------------------------------------------------------
+// v2: all data of the session was written, check the CRC of the image in flash
+//-----------------------------------------------------------------------------
+static void FinishSession(void)
+{
+	if ( crc_calc((uint8_t*)session.addr, session.len)==session.checksum )
+	{
+		session_done = true;
+		SendReport(CMD_ID_DONE, NO_ERROR, 0);
+	}
+	else
+	{
+		SendReport(CMD_ID_DONE, IMAGE_WRONG_CHECKSUM, 0);
+	}
+	session.len = 0;
+}
+//-----------------------------------------------------------------------------
+// returns true if the flash page already holds the staged data
+//-----------------------------------------------------------------------------
+static bool PageUnchanged(page_buf_t * page)
+{
+	// the staging buffer is 0xFF beyond 'len', like the erased flash
+	uint32_t * flash = (uint32_t*)page->addr;
+	uint32_t * data = (uint32_t*)page->data;
+	for (int i = 0; i < flash_page_size/4; i++)
+	{
+		if ( flash[i]!=data[i] )
+			return false;
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------
+// returns the offset of the first byte which differs from the staged data, -1 if none
+//-----------------------------------------------------------------------------
+static int VerifyPage(page_buf_t * page)
+{
+	uint32_t * flash = (uint32_t*)page->addr;
+	uint32_t * data = (uint32_t*)page->data;
+	for (int i = 0; i < flash_page_size/4; i++)
+	{
+		uint32_t diff = flash[i] ^ data[i];
+		if (diff)
+			return i*4 + __builtin_ctz(diff)/8;
+	}
+	return -1;
+}
+#endif
+//-----------------------------------------------------------------------------
+// progress of the page at the tail of rx_queue
+//-----------------------------------------------------------------------------
+enum { PAGE_NEW, PAGE_ERASE, PAGE_PROGRAM, PAGE_DONE };
+uint8_t page_state;
+error_t page_err;
+#if UPLOAD_V2
+bool page_accepted; // passed the checks, not a duplicate
+int page_err_offset;
+//-----------------------------------------------------------------------------
+// v2 checks of a new page, true if it has to be erased and programmed
+//-----------------------------------------------------------------------------
+static bool AcceptPage(page_buf_t * page, bool windowed)
+{
+	page_accepted = true;
+	page_err_offset = 0;
+	page_skipped = false;
+	if (windowed)
+	{
+		if ( crc_calc(page->data, page->len)!=page->checksum )
+		{	// corrupted frame, the host has to resend it
+			SendReport(CMD_ID_NAK, IMAGE_WRONG_CHECKSUM, page->seq);
+			page_accepted = false;
+		}
+		else if ( PageWritten(page->seq) )
+			page_accepted = false; // resent frame was queued twice
+	}
+	else if ( session.len && (session.flags & SESSION_PAGE_CRC) &&
+			  crc_calc(page->data, page->len)!=page->checksum )
+	{	// corrupted stream, aborts the session
+		page_err = IMAGE_WRONG_CHECKSUM;
+		page_accepted = false;
+	}
+	if (!page_accepted)
+		return false;
+	page_skipped = ( session.len && (session.flags & SESSION_SKIP_SAME) && PageUnchanged(page) );
+	if (page_skipped)
+		++pages_skipped;
+	return !page_skipped;
+}
+//-----------------------------------------------------------------------------
+// v2: report a processed page
+//-----------------------------------------------------------------------------
+static void PageDone(uint16_t seq, bool windowed, bool write, error_t err, int offset)
+{
+	if (session.len && err)
+	{	// report the failed page, the host can resend just this page
+		trace("FLASH_ERR:"); ntrace(seq, 0); trace("\n");
+		if (windowed)
+		{
+			SendPageReport(CMD_ID_NAK, err, seq, offset);
+		}
+		else
+		{	// a stream can not be repeated partially, abort the session.
+			// The host can start a new session for this page.
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				session.len = 0;
+				rx_stage = NULL;
+			}
+			queue_reset(&rx_queue); // drop the pages staged after the failed one
+			SendPageReport(CMD_ID_DONE, err, seq, offset);
+		}
+	}
+	else if (windowed && write)
+	{
+		page_map[seq>>5] |= (1UL<<(seq & 31));
+		while ( ack_base<num_frames && PageWritten(ack_base) )
+			++ack_base;
+		AckFrame(seq);
+	}
+	else if (session.len && !windowed)
+	{
+		SendReport(CMD_ID_PROGRESS, NO_ERROR, seq);
+	}
+}
+#endif
+//-----------------------------------------------------------------------------
+// Erase and program the staged pages. Called from yield(), outside of ISR.
+// The flash operations run asynchronously, the function returns while the
+// flash is busy and continues on the next call.
+//-----------------------------------------------------------------------------
+void ProcessRxQueue(void)
+{
+#if UPLOAD_DIRECT
+	ProcessDirect();
+#endif
+
+	while ( !queue_empty(&rx_queue) )
+	{
+		page_buf_t * page = &rx_pages[queue_rd_slot(&rx_queue)];
+#if UPLOAD_V2
+		bool windowed = (session.len && (session.flags & SESSION_WINDOWED));
+		uint16_t seq = windowed ? page->seq : (page->addr - session.addr) / flash_page_size;
+#endif
+
+		if (page_state==PAGE_NEW)
+		{
+			page_err = NO_ERROR;
+			page_state = PAGE_DONE;
+#if UPLOAD_V2
+			if ( AcceptPage(page, windowed) )
+#endif
+			{	// erase and program the complete page in one pass
+				LED_ON;
+				EVT(EVT_FLASH_ERASE, 0, page->addr);
+				flash_begin_erase((uint16_t*)page->addr);
+				page_state = PAGE_ERASE;
+			}
+		}
+		if (page_state==PAGE_ERASE)
+		{
+			if ( flash_busy() )
+				break;
+			if ( flash_state()==FLASH_STATE_DONE )
+			{
+				EVT(EVT_FLASH_PROGRAM, (page->len+1)>>1, page->addr);
+				flash_begin_program((uint16_t*)page->addr, (uint16_t*)page->data, (page->len+1)>>1);
+				page_state = PAGE_PROGRAM;
+			}
+			else
+			{
+				LED_OFF;
+				page_err = FLASH_PROGRAM_ERROR;
+				page_state = PAGE_DONE;
+			}
+		}
+		if (page_state==PAGE_PROGRAM)
+		{
+			if ( flash_busy() )
+				break;
+			LED_OFF;
+			if ( flash_state()!=FLASH_STATE_DONE )
+			{
+				page_err = FLASH_PROGRAM_ERROR;
+#if UPLOAD_V2
+				page_err_offset = VerifyPage(page); // the halfword which failed
+#endif
+			}
+#if UPLOAD_V2
+			else if ( session.len && (session.flags & SESSION_VERIFY) )
+			{	// the ISR fills the next staging buffer meanwhile
+				page_err_offset = VerifyPage(page);
+				if (page_err_offset>=0)
+					page_err = FLASH_VERIFY_ERROR;
+			}
+			if (page_err==NO_ERROR && session.len)
+				++pages_written;
+#endif
+			page_state = PAGE_DONE;
+		}
+		// PAGE_DONE
+		StatsPage(page);
+		EVT(EVT_PAGE_DONE, page_err, page->addr);
+#if UPLOAD_V2
+		bool write = page_accepted;
+		error_t err = page_err;
+		int offset = page_err_offset;
+#endif
+		page_state = PAGE_NEW;
+		queue_pop(&rx_queue);
+#if UPLOAD_V2
+		PageDone(seq, windowed, write, err, offset);
+#endif
+
+		if (rx_pending)
+		{	// a packet is waiting in PMA for a free staging buffer, process it now
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				rx_pending = 0;
+				StatsNak(false);
+				OnEpBulkOut();
+			}
+		}
+	}
+
+#if UPLOAD_V2
+	if ( session_hold && queue_empty(&rx_queue) && !flash_busy() )
+	{	// the flash is idle, start the held session
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			session_hold = false;
+			rx_pending = 0;
+			OnEpBulkOut();
+		}
+	}
+
+	if ( session.len && rx_stage==NULL && queue_empty(&rx_queue) )
+	{
+		if ( !(session.flags & SESSION_WINDOWED) )
+		{
+			if (rx_remaining==0)
+				FinishSession();
+		}
+		else if ( (session.flags & SESSION_SPARSE) ? sparse_end : (ack_base==num_frames) )
+			FinishSession();
+	}
+
+	FlushReport();
+#endif
+}
+//-----------------------------------------------------------------------------
+// returns true when the upload is finished and all data was written into flash
+//-----------------------------------------------------------------------------
+bool UploadComplete(void)
+{
+	if ( rx_stage!=NULL || !queue_empty(&rx_queue) )
+		return false;
+
+#if UPLOAD_V2
+	if (session_done) // the final report must have been collected by the host
+	{
+		if ( report_pending || !TxIdle() )
+			return false;
+#if UPLOAD_STATS
+		// keep the statistics readable for a while, CMD_ID_STATS ends the wait
+		return ( stats.read || (dwt_cycles() - stats.done_at)>STATS_HOLD_MS*(F_CPU/1000) );
+#else
+		return true;
+#endif
+	}
+#endif
+
+	return ( num_pages>0 && crt_page==num_pages );
+}
+#if USB_SOF_STATS
+//-----------------------------------------------------------------------------
+// start of frame: account the finished frame, start the next one
+//-----------------------------------------------------------------------------
+__ramfunc static void OnSof(void)
+{
+	uint16_t fn = USB_FNR & 0x7FF;
+	if (frame.valid)
+	{
+		uint16_t gap = (fn - frame.fn) & 0x7FF;
+		if (gap>1)
+			frame_stats.missed += gap - 1;
+		int packets = frame.out + frame.in;
+		bool nak = frame.nak || rx_pending || tx_hold;
+		frame_stats.frames++;
+		if (nak)
+			frame_stats.nak++;
+		else if (packets==0)
+			frame_stats.idle++;
+		frame_stats.out_packets += frame.out;
+		frame_stats.in_packets += frame.in;
+		frame_stats.hist[(packets<FRAME_HIST) ? packets : (FRAME_HIST-1)]++;
+	}
+	frame.fn = fn;
+	frame.out = frame.in = 0;
+	frame.nak = rx_pending || tx_hold;
+	frame.valid = true;
+}
+#endif
+//-----------------------------------------------------------------------------
+//--------------- USB-Interrupt-Handler ---------------------------------------
+//-----------------------------------------------------------------------------
+__ramfunc void NAME_OF_USB_IRQ_HANDLER(void)
+{
+	PROF_START(PROF_USB_IRQ);
+    uint32_t irqStatus = USB_ISTR; // Interrupt-Status
+	EVT(EVT_USB_IRQ, irqStatus, 0);
+
+#if USB_STATS
+	if (irqStatus & ERR) // only counted, the hardware retries
+		usb_stats.usb_errors++;
+	if (irqStatus & PMAOVR)
+		usb_stats.pma_overruns++;
+#endif
+#if USB_SOF_STATS
+	if (irqStatus & SOF)
+		OnSof();
+#endif
+
+	if (irqStatus & WKUP) // Suspend-->Resume
+	{
+		trace("WKUP\n");
+		USB_CNTR &= ~(FSUSP | LP_MODE);
+		usb_state.suspended = false;
+	}
+	else if (irqStatus & SUSP) // after 3 ms break -->Suspend
+	{
+		trace("SUSP\n");
+		USB_STAT(usb_stats.suspends++);
+		EVT(EVT_SUSPEND, 0, 0);
 		usb_state.suspended = true;
 		USB_CNTR |= (FSUSP | LP_MODE);
 	}
@@ -853,13 +2783,19 @@ void NAME_OF_USB_IRQ_HANDLER(void)
 	if (irqStatus & RESET) // Bus Reset
 	{
 		trace("RESET\n");
+		USB_STAT(usb_stats.resets++);
+		EVT(EVT_RESET, 0, 0);
 		CMD.configuration = 0;
 		InitEndpoints();
+#if TX_RING
+		TxReset();
+#endif
 	}
 	else
 	{	// Endpoint Interrupts
 		while ( (irqStatus = USB_ISTR) & CTR )
 		{
+			PROF_START(PROF_CTR);
 			USB_ISTR = ~CTR; // clear IRQ bit
 			uint8_t ep = irqStatus & MASK_EP;
 			uint16_t epStatus = USB_EpRegs(ep);
@@ -886,7 +2822,30 @@ void NAME_OF_USB_IRQ_HANDLER(void)
 				else if (ep == EP_DATA)
 				{
 					trace("DATA-");
-					OnEpBulkOut();
+					USB_STAT(usb_stats.rx_packets++);
+					USB_STAT(usb_stats.rx_bytes += GetRxCount(EP_DATA));
+					EVT(EVT_RX, EP_DATA, GetRxCount(EP_DATA));
+#if USB_SOF_STATS
+					frame.out++;
+#endif
+					if (rx_pending || tx_hold)
+					{	// double buffered: the held packet goes first, see OnEpBulkOut()
+#if EP_DATA_DBL_BUF
+						rx_skipped = 1;
+#endif
+					}
+					else
+					{
+						TakeDataRx();
+#if UPLOAD_STATS
+						uint32_t t = dwt_cycles();
+						OnEpBulkOut();
+						if (session.len)
+							stats.isr_time += dwt_cycles() - t;
+#else
+						OnEpBulkOut();
+#endif
+					}
 				}
 				else if (ep == EP_COMM)
 				{
@@ -912,9 +2871,12 @@ void NAME_OF_USB_IRQ_HANDLER(void)
 					trace("CTRL-");
 					OnEpCtrlIn();
 				}
-				else if (ep == EP_DATA)
+				else if (ep == EP_DATA_TX)
 				{
 					trace("DATA-");
+#if USB_SOF_STATS
+					frame.in++;
+#endif
 					OnEpBulkIn();
 				}
 				else if (ep == EP_COMM)
@@ -923,7 +2885,9 @@ void NAME_OF_USB_IRQ_HANDLER(void)
 //					OnEpIntIn();
 				}
 			}
+			PROF_END(PROF_CTR);
 		}
 	}
+	PROF_END(PROF_USB_IRQ);
 }
 
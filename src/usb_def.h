@@ -26,6 +26,37 @@
 /* Take the number from the reference manual of your C. */
 #define USB_IRQ_NUMBER 20
 
+/* Receive on EP_DATA OUT with the hardware double buffering (DBL_BUF).
+ * The hardware can then ACK the next packet while the previous one is still read out.
+ * A double buffered endpoint is unidirectional, so EP_DATA IN uses a separate EP register. */
+#ifndef EP_DATA_DBL_BUF
+#define EP_DATA_DBL_BUF 0
+#endif
+
+/* Copy the packets with the unrolled, alignment aware PMA kernels, else halfword by halfword */
+#ifndef PMA_FAST_COPY
+#define PMA_FAST_COPY 0
+#endif
+
+/* Measure the PMA copy kernels with the DWT cycle counter at start-up, see PmaBench() */
+#ifndef PMA_BENCH
+#define PMA_BENCH 0
+#endif
+#if PMA_BENCH && !PMA_FAST_COPY
+#error "PMA_BENCH measures the kernels of PMA_FAST_COPY"
+#endif
+
+/* Count bus events, packets and reported errors, see VENDOR_REQ_STATS.
+ * The flash counters of the answer need FLASH_STATS (flash.h). */
+#ifndef USB_STATS
+#define USB_STATS 0
+#endif
+
+/* Sample the bus utilization on each SOF (1 ms), see VENDOR_REQ_FRAMES */
+#ifndef USB_SOF_STATS
+#define USB_SOF_STATS 0
+#endif
+
 // Enable trace messages
 #define ENABLE_TRACING 0
 
@@ -96,23 +127,27 @@
  All USB-Registers are 16 Bit, but they must be read/write as 32 bit data
  */
 
-/* USB device (base address 0x4000 5C00) */
+/* USB device (base address 0x4000 5C00).
+ * USB_BASE and USB_RAM can be predefined to map the peripheral to other
+ * memory, e.g. to simulated registers in a host build. */
+#ifndef USB_BASE
 #define USB_BASE      0x40005C00
-#define USB_EpRegs(x) (*(volatile uint32_t *)(0x40005C00 + 4*(x)))
-#define USB_EP0R      (*(volatile uint32_t *)(0x40005C00))
-#define USB_EP1R      (*(volatile uint32_t *)(0x40005C04))
-#define USB_EP2R      (*(volatile uint32_t *)(0x40005C08))
-#define USB_EP3R      (*(volatile uint32_t *)(0x40005C0C))
-#define USB_EP4R      (*(volatile uint32_t *)(0x40005C10))
-#define USB_EP5R      (*(volatile uint32_t *)(0x40005C14))
-#define USB_EP6R      (*(volatile uint32_t *)(0x40005C18))
-#define USB_EP7R      (*(volatile uint32_t *)(0x40005C1C))
-
-#define USB_CNTR      (*(volatile uint32_t *)(0x40005C40))
-#define USB_ISTR      (*(volatile uint32_t *)(0x40005C44))
-#define USB_FNR       (*(volatile uint32_t *)(0x40005C48))
-#define USB_DADDR     (*(volatile uint32_t *)(0x40005C4C))
-#define USB_BTABLE    (*(volatile uint32_t *)(0x40005C50))
+#endif
+#define USB_EpRegs(x) (*(volatile uint32_t *)(USB_BASE + 4*(x)))
+#define USB_EP0R      (*(volatile uint32_t *)(USB_BASE + 0x00))
+#define USB_EP1R      (*(volatile uint32_t *)(USB_BASE + 0x04))
+#define USB_EP2R      (*(volatile uint32_t *)(USB_BASE + 0x08))
+#define USB_EP3R      (*(volatile uint32_t *)(USB_BASE + 0x0C))
+#define USB_EP4R      (*(volatile uint32_t *)(USB_BASE + 0x10))
+#define USB_EP5R      (*(volatile uint32_t *)(USB_BASE + 0x14))
+#define USB_EP6R      (*(volatile uint32_t *)(USB_BASE + 0x18))
+#define USB_EP7R      (*(volatile uint32_t *)(USB_BASE + 0x1C))
+
+#define USB_CNTR      (*(volatile uint32_t *)(USB_BASE + 0x40))
+#define USB_ISTR      (*(volatile uint32_t *)(USB_BASE + 0x44))
+#define USB_FNR       (*(volatile uint32_t *)(USB_BASE + 0x48))
+#define USB_DADDR     (*(volatile uint32_t *)(USB_BASE + 0x4C))
+#define USB_BTABLE    (*(volatile uint32_t *)(USB_BASE + 0x50))
 
 /* Control register (USB_CNTR) */
 #define USB_CNTR_CTRM_BIT              15
@@ -218,9 +253,23 @@
 #define EP_COMM_TX_OFFSET  (EP_DATA_RX_OFFSET + EP_DATA_LEN)	// start: +64, length: 8
 #define EP_COMM_RX_OFFSET  (EP_COMM_TX_OFFSET + EP_INT_MAX_LEN)	// start: +8, length: 8
 
+#if EP_DATA_DBL_BUF
+// EP1 = Bulk-OUT for DATA, double buffered: the Tx buffer is used as Rx buffer 0
+#define EP_DATA_RX0_OFFSET  EP_DATA_TX_OFFSET
+#define EP_DATA_RX1_OFFSET  EP_DATA_RX_OFFSET
+// EP3 = Bulk-IN for DATA, same EP address as EP1
+#define EP_DATA_IN_OFFSET  (EP_COMM_RX_OFFSET + EP_INT_MAX_LEN)	// start: +8, length: 64
+#define EP_DATA_TX  3	// EP register used to send on EP_DATA IN
+#else
+#define EP_DATA_IN_OFFSET  EP_DATA_TX_OFFSET
+#define EP_DATA_TX  1	// EP register used to send on EP_DATA IN, same as EP_DATA
+#endif
+
 
 // Allocation of the EP buffers
+#ifndef USB_RAM
 #define USB_RAM       0x40006000
+#endif
 /**/
 #define EP_CTRL_TX_BUF_ADDRESS	(USB_RAM + (EP_CTRL_TX_OFFSET<<UMEM_SHIFT))
 #define EP_CTRL_RX_BUF_ADDRESS	(USB_RAM + (EP_CTRL_RX_OFFSET<<UMEM_SHIFT))
@@ -231,6 +280,8 @@
 #define EP_COMM_TX_BUF_ADDRESS	(USB_RAM + (EP_COMM_TX_OFFSET<<UMEM_SHIFT))
 #define EP_COMM_RX_BUF_ADDRESS	(USB_RAM + (EP_COMM_RX_OFFSET<<UMEM_SHIFT))
 
+#define EP_DATA_IN_BUF_ADDRESS	(USB_RAM + (EP_DATA_IN_OFFSET<<UMEM_SHIFT))
+
 
 // EP table
 typedef struct epTableEntry_t
@@ -245,7 +296,7 @@ typedef struct epTableAddress_t {
     uint32_t * txAddr;
     uint32_t * rxAddr;
 } epTableAddress_t;
-extern const epTableAddress_t epTableAddr[2]; // number of EPs
+extern epTableAddress_t epTableAddr[EP_DATA_TX+1]; // number of EPs
 
 #define EP_TABLE_OFFSET		400    // storing 64 bytes after 400
 
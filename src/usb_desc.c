@@ -102,7 +102,7 @@ const usb_device_descriptor deviceDescriptor = {
     .bMaxPacketSize0 = MAX_USB_PACKET_SIZE,
     .idVendor = USB_VID,
     .idProduct = USB_PID,
-    .bcdDevice = 0x0220,  //  Device Release number 2.2
+    .bcdDevice = 0x0300,  //  Device Release number 3.0: the application starts at 0x08002000 (2.2: 0x08001000)
     .iManufacturer = USB_STRINGS_MANUFACTURER,
     .iProduct = USB_STRINGS_PRODUCT,
     .iSerialNumber = 0, //USB_STRINGS_SERIAL_NUMBER,
@@ -8,6 +8,11 @@
 #include "cdc.h"
 #include "gpio.h"
 #include "flash.h"
+#include "queue.h"
+#include "crc.h"
+#include "lz.h"
+#include "prof.h"
+#include "evt.h"
 
 /******* Struktur des Setup-Paketes *****/
 typedef struct
@@ -55,6 +60,24 @@ extern int DataBeginTransmit();
 extern void DataBeginReceive(); // called when Rx data can be processed again
 extern int ReadControlBlock(uint8_t* pBuffer, int maxlen);
 extern int SendData(int ep, uint8_t* pBuffer, int count);
+extern void Read_PMA(uint8_t* dest, uint32_t * src, int count);
+extern void Read_PMA16(uint16_t * dest, const uint32_t * src, int n);
+#if PMA_BENCH
+extern uint32_t pma_bench[];
+extern void PmaBench(void);
+#endif
+
+// EP_DATA IN transmit ring, needed by the v2 reports and the queries. v1 alone
+// sends each answer straight, the host reads it before it sends on.
+#define TX_RING			(UPLOAD_V2 || UPLOAD_MANIFEST || FLASH_TIMING || PROFILE || EVT_TRACE)
+// power of two
+#define TX_RING_LEN		256
+// Room for the answers to one OUT packet: the largest reply (profile_t),
+// a report and an error code. Else the packet is held until the host reads.
+#define TX_REPLY_MAX	(int)(sizeof(profile_t) + sizeof(report_t) + sizeof(error_t))
+extern bool TxWrite(const void * data, int len);
+extern int TxFree(void);
+extern bool TxIdle(void);
 //--------------------------------------------------------------------------
 static inline void ACK(void)
 {
@@ -93,10 +116,12 @@ static inline bool IsVendorRequest(void)
 #define LED_OFF		gpio_write_pin(LED_BUILTIN, 1)
 
 //-----------------------------------------------------------------------------
+#ifndef FLASH_BASE // can be predefined to run on a flash image in a host build
 #define FLASH_BASE			(0x08000000)
+#endif
 #define SRAM_BASE			(0x20000000)
 // Bootloader size
-#define BOOTLOADER_SIZE		(4 * 1024)
+#define BOOTLOADER_SIZE		(8 * 1024) // keep in sync with the ROM length in LinkerScript.ld
 
 // SRAM size
 #define SRAM_SIZE			(20 * 1024)
@@ -104,12 +129,47 @@ static inline bool IsVendorRequest(void)
 // SRAM end (bottom of stack)
 #define SRAM_END			(SRAM_BASE + SRAM_SIZE)
 
-// CDC Bootloader takes 4 kb flash.
+// CDC Bootloader takes 8 kb flash, the application starts at 0x08002000.
+// Up to device release 2.2 (bcdDevice, usb_desc.c) it was 4 kb and 0x08001000.
 #define USER_PROGRAM		(FLASH_BASE + BOOTLOADER_SIZE)
+
+// Flash geometry, read at runtime by Setup_sys() from the flash size register
+#ifndef FLASH_SIZE_ADDR
+#define FLASH_SIZE_ADDR		0x1FFFF7E0
+#endif
+#define FLASH_SIZE_REG		(*(volatile uint16_t*)FLASH_SIZE_ADDR) // in KB
+#define FLASH_SIZE_MAX		(512 * 1024) // the second bank of XL density parts is not supported
+#define FLASH_PAGE_MAX		2048 // high density and connectivity line
+#define FLASH_PAGES_MAX		(FLASH_SIZE_MAX / FLASH_PAGE_MAX)
+#define FLASH_END			(FLASH_BASE + flash_size)
+extern uint32_t flash_size; // bytes
+extern uint16_t flash_page_size; // the unit of erase
 //-----------------------------------------------------------------------------
+#define CMD_START			0x41BE
+// command IDs
+#define CMD_ID_NUM_PAGES	0x20 // v1: number of pages to flash, CMD_WRONG_ADDRESS if they exceed the flash
+#define CMD_ID_PAGE			0x21 // v1: page header, followed by the page data
+#define CMD_ID_SESSION		0x22 // v2: session header, followed by the image data stream
+#define CMD_ID_PROGRESS		0x23 // v2: report from device, a flash page was written
+#define CMD_ID_DONE			0x24 // v2: report from device, session finished or aborted
+#define CMD_ID_FRAME		0x25 // v2 windowed: frame header, followed by the data of one flash page
+#define CMD_ID_ACK			0x26 // v2 windowed: report from device, a flash page was written
+#define CMD_ID_NAK			0x27 // v2 windowed: report from device, a frame was rejected and must be resent
+#define CMD_ID_INFO			0x29 // query the device geometry, cmd_t, answered with info_t
+#define CMD_ID_DUMP			0x2A // read flash over EP_DATA IN, session_t layout with addr and len
+#define CMD_ID_MANIFEST		0x28 // query the CRC-32 (crc.h) of flash pages, cmd_t: page = first flash page
+								 // after USER_PROGRAM, data_len = number of pages (0: up to the flash end)
+#define CMD_ID_STATS		0x2B // query the statistics of the last v2 session, cmd_t, answered with stats_t
+#define CMD_ID_PROFILE		0x2C // query a profiling probe (prof.h), cmd_t: page = probe, data_len = 1: clear it, answered with profile_t
+#define CMD_ID_EVENTS		0x2D // read the event trace (evt.h), cmd_t, echoed with page = lost events (max. 255),
+								 // data_len = number of records, the records follow
+#define CMD_ID_FLASH_TIMING	0x2E // measure erase and program times on a scratch flash page, its content is lost,
+								 // cmd_t: page = flash page after USER_PROGRAM, data_len = rounds, answered with timing_t.
+								 // The page must lie after the application, it and all pages above must be erased.
+
 typedef union cmd_t {
 	uint8_t data[8];
-	struct {
+	struct __attribute((packed)) {
 		uint16_t start; // 0x41BE
 		uint8_t id;
 		uint8_t page;
@@ -119,12 +179,214 @@ typedef union cmd_t {
 } __attribute((packed)) cmd_t;
 extern cmd_t cmd;
 
-#define PAGE_SIZE	1024
+// v2 session header
+typedef union session_t {
+	uint8_t data[18];
+	struct __attribute((packed)) {
+		uint16_t start; // 0x41BE
+		uint8_t id; // 0x22
+		uint8_t flags; // SESSION_xxx
+		uint32_t addr; // flash address of the image, aligned to a flash page
+		uint32_t len; // number of image bytes, uncompressed
+		uint32_t checksum; // CRC-32 of the image, see crc.h
+		uint16_t crc; // lower half of the CRC-32 of the previous bytes
+	};
+} __attribute((packed)) session_t;
+
+// session flags
+#define SESSION_WINDOWED	0x01 // the image is sent as frames, see frame_t
+#define SESSION_SKIP_SAME	0x02 // pages identical to the flash content are not erased and programmed
+#define SESSION_VERIFY		0x04 // each programmed page is read back and compared with the received data
+#define SESSION_COMPRESSED	0x08 // the data stream is LZSS compressed (lz.h), not with SESSION_WINDOWED
+#define SESSION_DIRECT		0x10 // each packet is programmed straight from PMA, only with SESSION_VERIFY
+#define SESSION_SPARSE		0x20 // windowed: only the changed pages are sent (see CMD_ID_MANIFEST), in any order.
+								 // The other pages keep their flash content, a frame with FRAME_END finishes the session.
+#define SESSION_PAGE_CRC	0x40 // plain stream: the data of each flash page is followed by its CRC-32,
+								 // 4 bytes little endian, checked before the page is programmed
+
+// Optional features, all off by default so that the bootloader fits into
+// BOOTLOADER_SIZE. A build with more features needs a larger BOOTLOADER_SIZE,
+// see README.md.
+
+// Protocol v2 support: streaming, windowed and sparse sessions, page CRC,
+// skipping and verifying pages, reports and CMD_ID_INFO. v1 is always supported.
+#ifndef UPLOAD_V2
+#define UPLOAD_V2			0
+#endif
+
+// Compressed upload support, takes about 1.2 KB SRAM
+#ifndef UPLOAD_LZ
+#define UPLOAD_LZ			0
+#endif
+
+// Direct upload support, no staging buffer copy. The packet is held in PMA
+// and programmed from yield(), the host sees NAKs meanwhile.
+#ifndef UPLOAD_DIRECT
+#define UPLOAD_DIRECT		0
+#endif
+
+// Page hash query, CMD_ID_MANIFEST
+#ifndef UPLOAD_MANIFEST
+#define UPLOAD_MANIFEST		0
+#endif
+
+// Flash read back, CMD_ID_DUMP
+#ifndef FLASH_DUMP
+#define FLASH_DUMP			0
+#endif
+
+// Flash timing characterization, CMD_ID_FLASH_TIMING
+#ifndef FLASH_TIMING
+#define FLASH_TIMING		0
+#endif
+
+// Session flags known by this device. A session header with other flags is
+// answered with the supported flags in the echo, and no session is started.
+#define SESSION_SUPPORTED	(SESSION_WINDOWED | SESSION_SKIP_SAME | SESSION_VERIFY | SESSION_SPARSE | SESSION_PAGE_CRC | \
+							 (UPLOAD_LZ ? SESSION_COMPRESSED : 0) | (UPLOAD_DIRECT ? SESSION_DIRECT : 0))
+
+// v2 windowed: frame header. Each flash page of the image is sent as one frame,
+// the pages may be sent in any order and are addressed by their sequence number.
+typedef union frame_t {
+	uint8_t data[14];
+	struct __attribute((packed)) {
+		uint16_t start; // 0x41BE
+		uint8_t id; // 0x25
+		uint8_t flags; // FRAME_xxx
+		uint16_t seq; // index of the flash page within the image
+		uint16_t len; // number of data bytes following, the flash page size except for the last page
+		uint32_t checksum; // CRC-32 of the data bytes
+		uint16_t crc; // lower half of the CRC-32 of the previous bytes
+	};
+} __attribute((packed)) frame_t;
+
+// frame flags
+#define FRAME_END			0x01 // sparse: all changed pages were sent, no data follows, seq and len are 0
+
+
+// Number of frames the host may send ahead of the first page not written yet, max. 32.
+// A sparse session has no window, each written page is reported by PROGRESS.
+#define UPLOAD_WINDOW		8
+
+// v2 report, sent asynchronously by the device
+typedef union report_t {
+	uint8_t data[18];
+	struct __attribute((packed)) {
+		uint16_t start; // 0x41BE
+		uint8_t id; // 0x23 .. 0x27
+		uint8_t err; // error_t
+		uint16_t pages; // number of flash pages erased and programmed in this session
+		uint16_t seq; // PROGRESS: the page just processed, ACK: all pages below were written,
+					  // NAK: the rejected page, DONE: the failed page on a flash error
+		union {
+			uint32_t bitmap; // windowed ACK: bit n is set if page seq+1+n was written
+			uint32_t offset; // FLASH_VERIFY_ERROR, FLASH_PROGRAM_ERROR: offset of the first wrong byte in page seq
+		};
+		uint8_t window; // windowed: number of frames which may be sent starting from the ACKed seq
+		uint8_t flags; // REPORT_xxx
+		uint16_t skipped; // number of unchanged flash pages which were not rewritten
+		uint16_t crc; // lower half of the CRC-32 of the previous bytes
+	};
+} __attribute((packed)) report_t;
+
+// device information, answer to CMD_ID_INFO
+typedef union info_t {
+	uint8_t data[20];
+	struct __attribute((packed)) {
+		uint16_t start; // 0x41BE
+		uint8_t id; // 0x29
+		uint8_t version; // protocol version, 2
+		uint32_t flash_size; // bytes
+		uint32_t user_start; // USER_PROGRAM
+		uint16_t page_size; // flash page size, the unit of erase
+		uint16_t pages; // number of flash pages from user_start to the flash end
+		uint8_t session_flags; // SESSION_SUPPORTED
+		uint8_t window; // UPLOAD_WINDOW
+		uint16_t crc; // lower half of the CRC-32 of the previous bytes
+	};
+} __attribute((packed)) info_t;
+
+// Upload statistics, measured with the DWT cycle counter
+#ifndef UPLOAD_STATS
+#define UPLOAD_STATS		0
+#endif
+#if (UPLOAD_LZ || UPLOAD_DIRECT || UPLOAD_STATS || FLASH_DUMP) && !UPLOAD_V2
+#error "UPLOAD_LZ, UPLOAD_DIRECT, UPLOAD_STATS and FLASH_DUMP need UPLOAD_V2"
+#endif
+// after a successful session the bootloader waits this long for CMD_ID_STATS before it starts the application
+#define STATS_HOLD_MS		1000
+
+// statistics of the last v2 session, answer to CMD_ID_STATS. Times in us.
+typedef union stats_t {
+	uint8_t data[36];
+	struct __attribute((packed)) {
+		uint16_t start; // 0x41BE
+		uint8_t id; // 0x2B
+		uint8_t err; // result of the session, 0xFF while it is running
+		uint32_t bytes; // image bytes received
+		uint32_t time; // session header received to final report
+		uint32_t nak_time; // packets held in PMA for a free staging buffer, the host sees NAKs
+		uint32_t isr_time; // spent in OnEpBulkOut() from the USB ISR
+		uint16_t pages; // staged pages written or skipped
+		uint32_t page_min; // latency of a staged page, queued to written
+		uint32_t page_max;
+		uint32_t page_sum;
+		uint16_t crc; // lower half of the CRC-32 of the previous bytes
+	};
+} __attribute((packed)) stats_t;
+
+// profiling probe, answer to CMD_ID_PROFILE. Times in core clocks.
+typedef union profile_t {
+	uint8_t data[54];
+	struct __attribute((packed)) {
+		uint16_t start; // 0x41BE
+		uint8_t id; // 0x2C
+		uint8_t probe; // enum prof_id
+		uint32_t min;
+		uint32_t max;
+		uint32_t sum;
+		uint32_t count;
+		uint16_t hist[PROF_HIST]; // see prof.h
+		uint16_t crc; // lower half of the CRC-32 of the previous bytes
+	};
+} __attribute((packed)) profile_t;
+
+// flash timing characterization, see CMD_ID_FLASH_TIMING
+#define FT_ROUNDS_MAX		8 // each round erases and programs the complete page
+#define FT_HIST				8
+#define FT_BUCKET_US		10 // width of a program time bucket
+
+// answer to CMD_ID_FLASH_TIMING. Times in core clocks (F_CPU).
+typedef union timing_t {
+	uint8_t data[54];
+	struct __attribute((packed)) {
+		uint16_t start; // 0x41BE
+		uint8_t id; // 0x2E
+		uint8_t err; // error_t, FLASH_PROGRAM_ERROR if the page could not be erased or programmed
+		uint16_t rounds; // page erases measured
+		uint16_t page; // the scratch page
+		uint32_t erase_min; // per page
+		uint32_t erase_max;
+		uint32_t erase_sum;
+		uint32_t prog_min; // per halfword
+		uint32_t prog_max;
+		uint32_t prog_sum;
+		uint32_t prog_count;
+		uint16_t prog_hist[FT_HIST]; // halfwords by program time, bucket i: i*FT_BUCKET_US us .., the last one: above
+		uint16_t crc; // lower half of the CRC-32 of the previous bytes
+	};
+} __attribute((packed)) timing_t;
+
+// report flags
+#define REPORT_SKIPPED		0x01 // PROGRESS, ACK: the page was identical to the flash content and not rewritten
+
+#define PAGE_SIZE	1024 // page size used by the upload protocol
+
 extern int Check_CRC(uint8_t * buff, int len);
+extern int Calculate_CRC(uint8_t * buff, int len);
 
 #define BAUD_RATE 230400
 
-typedef enum {BUF_EMPTY, BUF_RECEIVING, BUF_FULL, BUF_SENDING} buf_status_t;
 typedef enum {
 	NO_ERROR,
 	NO_SETUP,
@@ -133,19 +395,76 @@ typedef enum {
 	DATA_UNDEFLOW,
 	CMD_WRONG_LENGTH,
 	CMD_WRONG_CRC,
-	CMD_WRONG_ID
+	CMD_WRONG_ID,
+	CMD_WRONG_ADDRESS,
+	IMAGE_WRONG_CHECKSUM,
+	FLASH_PROGRAM_ERROR, // FLASH_SR_PGERR or FLASH_SR_WRPRTERR was set
+	FLASH_VERIFY_ERROR, // the programmed page differs from the received data
+	DATA_WRONG_FORMAT, // the compressed stream is corrupted
+	ERROR_NUM // number of error codes
 } error_t;
 
-typedef struct buf_params_t {
-	buf_status_t status;
-	int wr_index;
-	int len;
-} buf_params_t;
-extern buf_params_t buf_params[2];
+// Vendor request on EP0 (device to host), answered with usb_stats_t.
+// Served by the control EP, so it can be polled during an upload.
+#define VENDOR_REQ_STATS	0x01
+
+typedef struct usb_stats_t {
+	uint16_t size; // sizeof(usb_stats_t)
+	uint16_t resets; // USB bus resets
+	uint16_t suspends;
+	uint16_t usb_errors; // ERR: CRC, bit stuffing, framing errors or timeouts
+	uint16_t pma_overruns; // PMAOVR
+	uint32_t rx_packets; // EP_DATA OUT packets
+	uint32_t rx_bytes;
+	uint32_t bytes_programmed;
+	uint32_t pages_erased;
+	uint32_t erase_time; // cumulative, us
+	uint32_t program_time; // cumulative, us
+	uint16_t errors[ERROR_NUM]; // reported errors by error_t
+} __attribute((packed)) usb_stats_t;
+
+// Vendor request on EP0 (device to host), answered with frame_stats_t.
+// wValue = 1 clears the statistics after the snapshot. Needs USB_SOF_STATS.
+#define VENDOR_REQ_FRAMES	0x02
+
+// A full speed frame (1 ms) carries at most 19 bulk packets of 64 bytes.
+#define FRAME_HIST			20
+
+typedef struct frame_stats_t {
+	uint32_t frames; // sampled frames
+	uint32_t idle; // frames without EP_DATA transaction and without NAK
+	uint32_t nak; // frames in which a packet was held in PMA, the host saw NAKs
+	uint32_t missed; // SOFs lost, from gaps in the USB_FNR frame number
+	uint32_t out_packets; // EP_DATA OUT
+	uint32_t in_packets; // EP_DATA IN
+	uint32_t hist[FRAME_HIST]; // frames by number of EP_DATA packets, the last one: FRAME_HIST-1 or more
+} __attribute((packed)) frame_stats_t;
+
+// Number of page staging buffers between the USB ISR and yield(), power of two
+#define RX_QUEUE_LEN	2
+
+// A complete flash page is received into SRAM, then erased and programmed in one pass
+typedef struct page_buf_t {
+	uint32_t addr;       // flash address of the page
+	uint16_t len;        // number of bytes to program from the page start
+	uint16_t seq;        // windowed: index of the page within the image
+	uint32_t checksum;   // windowed, SESSION_PAGE_CRC: expected CRC-32 of the data bytes
+	uint32_t queued;     // DWT cycles when the page was queued, see UPLOAD_STATS
+	uint8_t data[FLASH_PAGE_MAX] __attribute__((aligned(4)));
+} page_buf_t;
+
+extern queue_t rx_queue;
+extern page_buf_t * volatile rx_stage;
 
 extern int num_pages; // number of total pages to flash
 extern int crt_page, page_offset;
 extern int header_ok;
+
+extern void ProcessRxQueue(void);
+extern bool UploadComplete(void);
+extern void ProcessManifest(void);
+extern void ProcessEvents(void);
+extern void ProcessFlashTiming(void);
 //-----------------------------------------------------------------------------
 
 
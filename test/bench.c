@@ -0,0 +1,122 @@
+/*
+ * bench.c
+ *
+ * Upload throughput benchmark on the host simulation (sim.h).
+ * Uploads 64, 128 and 256 KB images to a 512 KB device (2 KB pages) in the
+ * v2 modes and reports, per upload:
+ * - the duration from the session header to the final report, and KB/s
+ * - the bus time of NAKed OUT transactions, and the time the device held
+ *   packets for a free staging buffer (stats_t.nak_time)
+ * - the ISR occupancy, the charged USB ISR time over the duration
+ * - the latency of the staged pages, queued to written (stats_t.page_*)
+ * The simulation is deterministic, the results only change with the firmware
+ * or the timing model.
+ *
+ * Build like sim_test (see sim.h) with -DUPLOAD_V2=1 -DUPLOAD_LZ=1 -DUPLOAD_DIRECT=1
+ * -DUPLOAD_STATS=1 -DRAM_CODE=1 and test/bench.c instead of test/sim_test.c.
+ * Usage: bench [tPROG us [tERASE us [ISR us]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "host.h"
+
+#if !UPLOAD_STATS
+#error "the benchmark reads the firmware statistics, build with -DUPLOAD_STATS=1"
+#endif
+#if !(UPLOAD_LZ && UPLOAD_DIRECT)
+#error "the benchmark runs all modes, build with -DUPLOAD_LZ=1 -DUPLOAD_DIRECT=1"
+#endif
+#if !RAM_CODE
+#error "without RAM_CODE the flash operations stall the USB ISR, build with -DRAM_CODE=1"
+#endif
+
+static uint8_t img[256 * 1024];
+
+static const int sizes_kb[] = { 64, 128, 256 };
+
+typedef struct bench_mode_t {
+	const char * name;
+	uint8_t flags;
+} bench_mode_t;
+
+static const bench_mode_t modes[] = {
+	{ "stream", 0 },
+	{ "compressed", SESSION_COMPRESSED },
+	{ "windowed", SESSION_WINDOWED },
+	{ "direct", SESSION_DIRECT },
+};
+
+//-----------------------------------------------------------------------------
+// one upload on a fresh device, prints its line of the table
+//-----------------------------------------------------------------------------
+static bool Run(const sim_config_t * cfg, const bench_mode_t * mode, int len)
+{
+	sim_init(cfg);
+	info_t info;
+	if ( !host_info(&info) )
+		return false;
+	host_image(1, img, len);
+	memset(&sim_stats, 0, sizeof(sim_stats));
+
+	host_result_t res = (mode->flags & SESSION_WINDOWED) ?
+		host_windowed(img, USER_PROGRAM, len, mode->flags, NULL) :
+		host_stream(img, USER_PROGRAM, len, mode->flags);
+	if ( res.err!=NO_ERROR )
+	{
+		printf("%-10s %4d KB  error %d\n", mode->name, len/1024, res.err);
+		return false;
+	}
+	sim_stats_t sim = sim_stats;
+
+	stats_t st;
+	host_cmd(CMD_ID_STATS, 0, 0);
+	if ( host_msg(st.data)!=sizeof(stats_t) || st.id!=CMD_ID_STATS )
+		return false;
+
+	double ms = res.time / (double)(SIM_CYCLES_US * 1000);
+	printf("%-10s %4d KB %9.1f %7.1f %9.1f %9.1f %7.2f %7.1f %7.1f %7.1f\n",
+		mode->name, len/1024, ms, len / 1024.0 / (ms / 1000),
+		sim.nak_cycles / (double)(SIM_CYCLES_US * 1000), st.nak_time / 1000.0,
+		100.0 * sim.isr_cycles / res.time,
+		st.page_min / 1000.0, st.pages ? st.page_sum / 1000.0 / st.pages : 0, st.page_max / 1000.0);
+	return true;
+}
+//-----------------------------------------------------------------------------
+int main(int argc, char ** argv)
+{
+	sim_config_t cfg = SIM_CONFIG_DEFAULT;
+	cfg.flash_kb = 512;
+	if (argc>1)
+		cfg.t_prog = atoi(argv[1]) * SIM_CYCLES_US;
+	if (argc>2)
+		cfg.t_erase = atoi(argv[2]) * SIM_CYCLES_US;
+	if (argc>3)
+		cfg.isr_cycles = atoi(argv[3]) * SIM_CYCLES_US;
+
+	printf("tPROG %u us, tERASE %u us, ISR %u us\n\n", cfg.t_prog / SIM_CYCLES_US,
+		cfg.t_erase / SIM_CYCLES_US, cfg.isr_cycles / SIM_CYCLES_US);
+	printf("%-10s %7s %9s %7s %9s %9s %7s %23s\n", "mode", "image", "time", "KB/s",
+		"bus NAK", "held", "ISR", "page latency");
+	printf("%-10s %7s %9s %7s %9s %9s %7s %7s %7s %7s\n", "", "", "ms", "",
+		"ms", "ms", "%", "min ms", "avg ms", "max ms");
+	int failed = 0;
+	for (unsigned m = 0; m < sizeof(modes)/sizeof(modes[0]); m++)
+	{
+		for (unsigned s = 0; s < sizeof(sizes_kb)/sizeof(sizes_kb[0]); s++)
+		{
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid==0) // sim_init() once per process
+				exit(Run(&cfg, &modes[m], sizes_kb[s] * 1024) ? 0 : 1);
+			int status;
+			waitpid(pid, &status, 0);
+			failed += !(WIFEXITED(status) && WEXITSTATUS(status)==0);
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,440 @@
+/*
+ * host.c
+ *
+ * Host side of the upload protocol, see host.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+
+static uint16_t page_size; // from CMD_ID_INFO
+
+host_fault_t host_fault;
+
+//-----------------------------------------------------------------------------
+// Senders
+//-----------------------------------------------------------------------------
+void host_cmd(uint8_t id, uint8_t page, uint16_t data_len)
+{
+	cmd_t c;
+	c.start = CMD_START;
+	c.id = id;
+	c.page = page;
+	c.data_len = data_len;
+	c.crc = Calculate_CRC(c.data, sizeof(cmd_t)-2);
+	sim_out(c.data, sizeof(cmd_t));
+}
+//-----------------------------------------------------------------------------
+void host_session(uint8_t id, uint8_t flags, uint32_t addr, uint32_t len, uint32_t checksum)
+{
+	session_t s;
+	s.start = CMD_START;
+	s.id = id;
+	s.flags = flags;
+	s.addr = addr;
+	s.len = len;
+	s.checksum = checksum;
+	s.crc = crc_calc_sw(s.data, sizeof(session_t)-2);
+	sim_out(s.data, sizeof(session_t));
+}
+//-----------------------------------------------------------------------------
+static void FrameHeader(frame_t * f, uint8_t flags, uint16_t seq, const uint8_t * data, uint16_t len)
+{
+	f->start = CMD_START;
+	f->id = CMD_ID_FRAME;
+	f->flags = flags;
+	f->seq = seq;
+	f->len = len;
+	f->checksum = len ? crc_calc_sw(data, len) : 0;
+	f->crc = crc_calc_sw(f->data, sizeof(frame_t)-2);
+}
+//-----------------------------------------------------------------------------
+void host_frame(uint8_t flags, uint16_t seq, const uint8_t * data, uint16_t len)
+{
+	frame_t f;
+	FrameHeader(&f, flags, seq, data, len);
+	sim_out(f.data, sizeof(frame_t));
+	if (len)
+		sim_out(data, len);
+}
+//-----------------------------------------------------------------------------
+// host_frame() of a windowed upload, damaged by the pending host_fault
+//-----------------------------------------------------------------------------
+static void FaultFrame(uint16_t seq, const uint8_t * data, uint16_t len)
+{
+	host_fault_kind_t kind = host_fault.kind;
+	bool hit = ( kind==HOST_OUT_OF_WINDOW ) ? (seq==0) : (kind && seq==host_fault.seq);
+	if (!hit)
+	{
+		host_frame(0, seq, data, len);
+		return;
+	}
+	host_fault.kind = HOST_FAULT_NONE;
+	frame_t f;
+	FrameHeader(&f, 0, seq, data, len);
+	switch (kind)
+	{
+	case HOST_DROP_PACKET:
+		sim_out(f.data, sizeof(frame_t));
+		sim_out(data + EP_DATA_LEN, len - EP_DATA_LEN);
+		break;
+	case HOST_BAD_CRC:
+		f.crc ^= 1;
+		sim_out(f.data, sizeof(frame_t));
+		sim_out(data, len);
+		break;
+	case HOST_BAD_DATA:
+	{
+		uint8_t buf[len];
+		memcpy(buf, data, len);
+		buf[len/2] ^= 0x01;
+		sim_out(f.data, sizeof(frame_t));
+		sim_out(buf, len);
+		break;
+	}
+	case HOST_OUT_OF_WINDOW:
+	{	// the faulty frame goes first, frame 0 follows
+		uint32_t pos = (uint32_t)host_fault.seq * page_size;
+		host_frame(0, host_fault.seq, data + pos, page_size);
+		host_frame(0, seq, data, len);
+		break;
+	}
+	case HOST_DUPLICATE:
+		host_frame(0, seq, data, len);
+		host_frame(0, seq, data, len);
+		break;
+	default:
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Receivers
+//-----------------------------------------------------------------------------
+static int in_needed;
+
+static bool InAvailable(void)
+{
+	return sim_in_count()>=in_needed;
+}
+//-----------------------------------------------------------------------------
+bool host_read(void * buf, int len)
+{
+	in_needed = len;
+	if ( !sim_run(InAvailable, HOST_TIMEOUT) )
+		return false;
+	sim_in(buf, len);
+	return true;
+}
+//-----------------------------------------------------------------------------
+static int MsgLen(uint8_t id)
+{
+	switch (id)
+	{
+	case CMD_ID_NUM_PAGES:
+	case CMD_ID_PAGE:
+	case CMD_ID_MANIFEST:
+	case CMD_ID_EVENTS:
+		return sizeof(cmd_t);
+	case CMD_ID_SESSION:
+	case CMD_ID_DUMP:
+		return sizeof(session_t);
+	case CMD_ID_PROGRESS:
+	case CMD_ID_DONE:
+	case CMD_ID_ACK:
+	case CMD_ID_NAK:
+		return sizeof(report_t);
+	case CMD_ID_INFO:
+		return sizeof(info_t);
+	case CMD_ID_STATS:
+		return sizeof(stats_t);
+	case CMD_ID_PROFILE:
+		return sizeof(profile_t);
+	case CMD_ID_FLASH_TIMING:
+		return sizeof(timing_t);
+	}
+	return 3;
+}
+//-----------------------------------------------------------------------------
+int host_msg(uint8_t * buf)
+{
+	if ( !host_read(buf, 2) )
+		return 0;
+	if ( (buf[0] | (buf[1]<<8))!=CMD_START )
+		return host_read(buf + 2, sizeof(error_t) - 2) ? (int)sizeof(error_t) : 0;
+	if ( !host_read(buf + 2, 1) )
+		return 0;
+	int len = MsgLen(buf[2]);
+	return host_read(buf + 3, len - 3) ? len : 0;
+}
+//-----------------------------------------------------------------------------
+bool host_info(info_t * info)
+{
+	host_cmd(CMD_ID_INFO, 0, 0);
+	if ( host_msg(info->data)!=sizeof(info_t) || info->id!=CMD_ID_INFO ||
+		 info->crc!=(uint16_t)crc_calc_sw(info->data, sizeof(info_t)-2) )
+		return false;
+	page_size = info->page_size;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Uploads
+//-----------------------------------------------------------------------------
+// waits for the echo of the session header
+//-----------------------------------------------------------------------------
+static bool SessionEcho(host_result_t * res)
+{
+	uint8_t msg[64];
+	int n = host_msg(msg);
+	if ( n!=sizeof(session_t) || msg[2]!=CMD_ID_SESSION )
+	{
+		res->err = (n==sizeof(error_t)) ? (error_t)msg[0] : HOST_TIMED_OUT;
+		return false;
+	}
+	res->flags = ((session_t*)msg)->flags;
+	return true;
+}
+//-----------------------------------------------------------------------------
+// handles a report, returns true on DONE
+//-----------------------------------------------------------------------------
+static bool Report(host_result_t * res, const report_t * rep)
+{
+	switch (rep->id)
+	{
+	case CMD_ID_PROGRESS:
+	case CMD_ID_ACK:
+		res->reports++;
+		return false;
+	case CMD_ID_NAK:
+		if (res->naks++==0)
+		{
+			res->nak_seq = rep->seq;
+			res->nak_err = rep->err;
+			res->nak_offset = rep->offset;
+		}
+		return false;
+	case CMD_ID_DONE:
+		res->err = rep->err;
+		res->pages = rep->pages;
+		res->skipped = rep->skipped;
+		res->seq = rep->seq;
+		res->offset = rep->offset;
+		return true;
+	}
+	return false;
+}
+//-----------------------------------------------------------------------------
+host_result_t host_stream(const uint8_t * img, uint32_t addr, uint32_t len, uint8_t flags)
+{
+	host_result_t res = { .err = HOST_TIMED_OUT };
+	uint64_t t0 = sim_time();
+	uint8_t * data = NULL;
+	int dlen = len;
+	if (flags & SESSION_COMPRESSED)
+	{
+		data = malloc(len*9/8 + 2);
+		dlen = host_lz(img, len, data);
+	}
+	else if (flags & SESSION_PAGE_CRC)
+	{	// each flash page is followed by its CRC-32
+		data = malloc(len + (len/page_size + 1)*4);
+		dlen = 0;
+		for (uint32_t pos = 0; pos < len; pos += page_size)
+		{
+			uint32_t n = (len - pos<page_size) ? (len - pos) : page_size;
+			uint32_t crc = crc_calc_sw(img + pos, n);
+			memcpy(data + dlen, img + pos, n);
+			memcpy(data + dlen + n, &crc, 4);
+			dlen += n + 4;
+		}
+	}
+	host_session(CMD_ID_SESSION, flags, addr, len, crc_calc_sw(img, len));
+	sim_out(data ? data : img, dlen);
+	free(data);
+
+	if ( SessionEcho(&res) && res.flags==flags )
+	{
+		uint8_t msg[64];
+		int n;
+		while ( (n = host_msg(msg))>0 )
+		{
+			if ( n==sizeof(report_t) && Report(&res, (report_t*)msg) )
+				break;
+		}
+	}
+	sim_out_cancel();
+	res.time = sim_time() - t0;
+	if (res.err!=NO_ERROR)
+	{	// the device answers the stream packets after an abort with errors, drop them
+		uint8_t buf[64];
+		sim_run(NULL, HOST_TIMEOUT);
+		while ( sim_in(buf, sizeof(buf))>0 )
+			;
+	}
+	return res;
+}
+//-----------------------------------------------------------------------------
+host_result_t host_windowed(const uint8_t * img, uint32_t addr, uint32_t len, uint8_t flags, const uint8_t * send)
+{
+	host_result_t res = { .err = HOST_TIMED_OUT };
+	uint64_t t0 = sim_time();
+	int frames = (len + page_size - 1) / page_size;
+	int next = 0, ack_base = 0;
+	int resent_seq = -1; // the last frame sent again
+
+	host_session(CMD_ID_SESSION, flags, addr, len, crc_calc_sw(img, len));
+	if ( !SessionEcho(&res) || res.flags!=flags )
+		goto done;
+
+#define FRAME(seq)	FaultFrame((seq), img + (seq)*page_size, \
+						((len - (seq)*page_size)<page_size) ? (len - (seq)*page_size) : page_size)
+	if (flags & SESSION_SPARSE)
+	{	// no window, the NAKs of the device pace the host
+		for (int seq = 0; seq < frames; seq++)
+			if (send[seq])
+				FRAME(seq);
+		host_frame(FRAME_END, 0, NULL, 0);
+	}
+	for (;;)
+	{
+		if ( !(flags & SESSION_SPARSE) )
+		{
+			while ( next<frames && next<(ack_base + UPLOAD_WINDOW) )
+			{
+				FRAME(next);
+				++next;
+			}
+		}
+		uint8_t msg[64];
+		int n = host_msg(msg);
+		if (n==0)
+			break;
+		if (n!=sizeof(report_t))
+			continue;
+		report_t * rep = (report_t*)msg;
+		if ( Report(&res, rep) )
+			break;
+		if (rep->id==CMD_ID_ACK)
+		{
+			ack_base = rep->seq;
+			if ( rep->bitmap && ack_base<next && ack_base!=resent_seq )
+			{	// pages above were written, the frame at the base was lost
+				if (res.sack_bitmap==0)
+				{
+					res.sack_seq = ack_base;
+					res.sack_bitmap = rep->bitmap;
+				}
+				FRAME(ack_base);
+				resent_seq = ack_base;
+				res.resent++;
+			}
+		}
+		else if ( rep->id==CMD_ID_NAK && rep->seq<frames &&
+				  ((flags & SESSION_SPARSE) || rep->seq<next) )
+		{	// resend the rejected frame, one beyond the window is sent when it opens
+			FRAME(rep->seq);
+			resent_seq = rep->seq;
+			res.resent++;
+			if (flags & SESSION_SPARSE)
+				host_frame(FRAME_END, 0, NULL, 0);
+		}
+	}
+#undef FRAME
+done:
+	sim_out_cancel();
+	res.time = sim_time() - t0;
+	return res;
+}
+//-----------------------------------------------------------------------------
+bool host_v1(const uint8_t * img, uint32_t len)
+{
+	uint8_t msg[64];
+	int pages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	host_cmd(CMD_ID_NUM_PAGES, pages, 0);
+	if ( host_msg(msg)!=sizeof(cmd_t) || msg[2]!=CMD_ID_NUM_PAGES )
+		return false;
+	for (int i = 0; i < pages; i++)
+	{
+		int n = (len - i*PAGE_SIZE<PAGE_SIZE) ? (len - i*PAGE_SIZE) : PAGE_SIZE;
+		host_cmd(CMD_ID_PAGE, i, n);
+		if ( host_msg(msg)!=sizeof(cmd_t) || msg[2]!=CMD_ID_PAGE )
+			return false;
+		sim_out(img + i*PAGE_SIZE, n);
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// runs of pseudo random bytes and of repeated patterns, about half compressible
+//-----------------------------------------------------------------------------
+void host_image(uint32_t seed, uint8_t * img, int len)
+{
+	uint32_t x = seed | 1;
+	for (int i = 0; i < len; )
+	{
+		x ^= x<<13; x ^= x>>17; x ^= x<<5;
+		int run = 16 + (x & 63);
+		bool random = x & 0x100;
+		for (int j = 0; j < run && i < len; j++, i++)
+		{
+			if (random)
+			{
+				x ^= x<<13; x ^= x>>17; x ^= x<<5;
+				img[i] = x;
+			}
+			else
+				img[i] = (i>=64) ? img[i - 64] : (uint8_t)j;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Greedy LZSS encoder, longest match in the window
+//-----------------------------------------------------------------------------
+#define LZ_MAX_MATCH	(LZ_MIN_MATCH + 63)
+
+int host_lz(const uint8_t * in, int len, uint8_t * out)
+{
+	int o = 0, ctrl = 0, items = 8;
+	for (int i = 0; i < len; )
+	{
+		if (items==8)
+		{
+			ctrl = o++;
+			out[ctrl] = 0;
+			items = 0;
+		}
+		int best = 0, dist = 0;
+		int max = (len - i<LZ_MAX_MATCH) ? (len - i) : LZ_MAX_MATCH;
+		for (int j = i - 1; j >= 0 && j >= i - LZ_WINDOW; j--)
+		{
+			int n = 0;
+			while ( n<max && in[j + n]==in[i + n] )
+				n++;
+			if (n>best)
+			{
+				best = n;
+				dist = i - j;
+				if (best==max)
+					break;
+			}
+		}
+		if (best>=LZ_MIN_MATCH)
+		{
+			out[ctrl] |= 1<<items;
+			out[o++] = (dist - 1) & 0xFF;
+			out[o++] = ((dist - 1)>>8) | ((best - LZ_MIN_MATCH)<<2);
+			i += best;
+		}
+		else
+		{
+			out[o++] = in[i++];
+		}
+		items++;
+	}
+	return o;
+}
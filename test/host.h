@@ -0,0 +1,77 @@
+/*
+ * host.h
+ *
+ * Host side of the upload protocol (usb_func.h), running on the simulation (sim.h).
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include "usb_func.h"
+#include "sim.h"
+
+#define HOST_TIMEOUT	(2000 * SIM_CYCLES_FRAME) // for one answer
+#define HOST_TIMED_OUT	ERROR_NUM // host_result_t.err: no answer
+
+// message senders, each header goes in its own packet
+extern void host_cmd(uint8_t id, uint8_t page, uint16_t data_len);
+extern void host_session(uint8_t id, uint8_t flags, uint32_t addr, uint32_t len, uint32_t checksum);
+extern void host_frame(uint8_t flags, uint16_t seq, const uint8_t * data, uint16_t len);
+
+// reads len bytes of bulk IN data, false on timeout
+extern bool host_read(void * buf, int len);
+// Reads the next message: an echo, a report, an answer or an error_t code.
+// Returns its length, 0 on timeout.
+extern int host_msg(uint8_t * buf);
+
+extern bool host_info(info_t * info);
+
+typedef struct host_result_t {
+	error_t err;		// of the DONE report, HOST_TIMED_OUT without one
+	uint8_t flags;		// session flags echoed by the device
+	uint16_t pages;		// of the DONE report
+	uint16_t skipped;
+	uint16_t seq;
+	uint32_t offset;	// of the DONE report on a flash error
+	int reports;		// PROGRESS and ACK reports
+	int naks;			// NAK reports
+	uint16_t nak_seq;	// of the first NAK report
+	error_t nak_err;
+	uint32_t nak_offset;
+	uint16_t sack_seq;	// of the first ACK with written pages above a missing one,
+	uint32_t sack_bitmap; // the host resends the missing page
+	int resent;			// frames sent again
+	uint64_t time;		// session header queued to DONE received, core clocks
+} host_result_t;
+
+// fault injection of host_windowed(), the first transmission of frame seq is damaged
+typedef enum {
+	HOST_FAULT_NONE,
+	HOST_DROP_PACKET,	// its first data packet is lost
+	HOST_BAD_CRC,		// the header CRC is wrong
+	HOST_BAD_DATA,		// a data byte is flipped, the frame checksum does not match
+	HOST_OUT_OF_WINDOW,	// it is sent ahead of frame 0, beyond the window
+	HOST_DUPLICATE,		// it is sent twice
+} host_fault_kind_t;
+
+typedef struct host_fault_t {
+	host_fault_kind_t kind; // cleared when injected
+	uint16_t seq;
+} host_fault_t;
+
+extern host_fault_t host_fault;
+
+// v2 stream: plain, SESSION_COMPRESSED, SESSION_DIRECT or SESSION_PAGE_CRC
+extern host_result_t host_stream(const uint8_t * img, uint32_t addr, uint32_t len, uint8_t flags);
+// v2 windowed. With SESSION_SPARSE only the pages with send[seq] set are sent.
+extern host_result_t host_windowed(const uint8_t * img, uint32_t addr, uint32_t len, uint8_t flags, const uint8_t * send);
+// v1 upload to USER_PROGRAM, true if all headers were echoed
+extern bool host_v1(const uint8_t * img, uint32_t len);
+
+// deterministic test image for the seed
+extern void host_image(uint32_t seed, uint8_t * img, int len);
+
+// LZSS encoder for lz.h, returns the compressed length. 'out' needs len*9/8 + 2 bytes.
+extern int host_lz(const uint8_t * in, int len, uint8_t * out);
+
+#endif // HOST_H
@@ -0,0 +1,89 @@
+/*
+ * queue_test.c
+ *
+ * Host stress test of the lock-free SPSC queue (src/queue.h).
+ * A producer thread fills slots with a sequence number and a pattern
+ * derived from it, a consumer thread checks order and content.
+ * Both sides also run into full and empty queues many times.
+ *
+ * Build and run on the host:
+ *   gcc -O2 -pthread -Isrc test/queue_test.c -o queue_test && ./queue_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "queue.h"
+
+#define SLOTS		4
+#define SLOT_WORDS	32
+#define COUNT		1000000
+
+typedef struct slot_t {
+	uint32_t seq;
+	uint32_t data[SLOT_WORDS];
+} slot_t;
+
+slot_t slots[SLOTS];
+queue_t q = QUEUE_INIT(SLOTS);
+volatile uint32_t full_hits, empty_hits;
+
+//-----------------------------------------------------------------------------
+static void * producer(void * arg)
+{
+	(void)arg;
+	for (uint32_t n = 0; n < COUNT; n++)
+	{
+		while ( queue_full(&q) )
+		{
+			full_hits++;
+			sched_yield(); // keeps single-CPU hosts fast
+		}
+		slot_t * s = &slots[queue_wr_slot(&q)];
+		s->seq = n;
+		for (int i = 0; i < SLOT_WORDS; i++)
+			s->data[i] = n * 2654435761u + i;
+		queue_push(&q);
+	}
+	return NULL;
+}
+//-----------------------------------------------------------------------------
+static void * consumer(void * arg)
+{
+	long * errors = arg;
+	for (uint32_t n = 0; n < COUNT; n++)
+	{
+		while ( queue_empty(&q) )
+		{
+			empty_hits++;
+			sched_yield();
+		}
+		if ( queue_count(&q)>SLOTS )
+			++*errors;
+		slot_t * s = &slots[queue_rd_slot(&q)];
+		if (s->seq!=n)
+			++*errors;
+		for (int i = 0; i < SLOT_WORDS; i++)
+			if ( s->data[i]!=n * 2654435761u + i )
+				++*errors;
+		queue_pop(&q);
+	}
+	return NULL;
+}
+//-----------------------------------------------------------------------------
+int main(void)
+{
+	long errors = 0;
+	pthread_t p, c;
+	pthread_create(&c, NULL, consumer, &errors);
+	pthread_create(&p, NULL, producer, NULL);
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+
+	if ( !queue_empty(&q) )
+		++errors;
+	printf("queue_test: %d slots passed, %ld errors, full %u, empty %u\n",
+		COUNT, errors, full_hits, empty_hits);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1014 @@
+/*
+ * sim.c
+ *
+ * Host simulation of the bootloader peripherals and of the USB host, see sim.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "usb_def.h"
+#include "usb_func.h"
+#include "nvic.h"
+#include "sim.h"
+
+// external definition of the C99 inline function in nvic.h
+extern void nvic_irq_disable(nvic_irq_num irq_num);
+
+extern void Main_init(void);
+extern void yield(void);
+extern void NAME_OF_USB_IRQ_HANDLER(void);
+extern void SysTick_Handler(void);
+
+//-----------------------------------------------------------------------------
+// Memory map
+//-----------------------------------------------------------------------------
+#define SIM_FLASH		0x08000000
+#define SIM_FLASH_SIZE	(512 * 1024)
+#define SIM_SYS			0x1FFFF000 // system memory page with the flash size register
+#define SIM_PERIPH		0x40000000
+#define SIM_PERIPH_SIZE	0x30000
+#define SIM_BITBAND		0x42000000 // peripheral bit band alias, written by rcc.c
+#define SIM_BITBAND_SIZE	0x2000000
+#define SIM_CORE		0xE0000000
+#define SIM_CORE_SIZE	0x100000
+#define SIM_PAGE		4096
+
+#define USB_PAGE		(USB_BASE & ~(SIM_PAGE-1))
+#define NVIC_PAGE		0xE000E000 // NVIC, SysTick and SCB
+
+// The peripherals and the flash are also mapped writable at another address,
+// the models access them there without being trapped.
+static uint8_t * flash_mem;
+static uint8_t * periph;
+static uint8_t * core;
+
+#define FLASH_MEM16(a)	(*(volatile uint16_t *)(flash_mem + ((a) - SIM_FLASH)))
+#define PERIPH_REG(a)	(*(volatile uint32_t *)(periph + ((a) - SIM_PERIPH)))
+#define CORE_REG(a)		(*(volatile uint32_t *)(core + ((a) - SIM_CORE)))
+
+#define USB_REG(off)	PERIPH_REG(USB_BASE + (off))
+#define EPR(r)			USB_REG(4*(r))
+#define ISTR_REG		USB_REG(0x44)
+#define CNTR_REG		USB_REG(0x40)
+#define FNR_REG			USB_REG(0x48)
+#define FLASH_REG(off)	PERIPH_REG(FLASH_REG_BASE + (off))
+#define FLASH_KEYR_OFF	0x04
+#define FLASH_SR_OFF	0x0C
+#define FLASH_CR_OFF	0x10
+#define FLASH_AR_OFF	0x14
+
+#define NEVER			UINT64_MAX
+
+sim_stats_t sim_stats;
+sim_flash_fault_t sim_flash_fault;
+static sim_config_t cfg;
+
+//-----------------------------------------------------------------------------
+// Time
+//-----------------------------------------------------------------------------
+static uint64_t now;		// core clocks
+static uint64_t cpu_free;	// end of the running ISR
+static uint64_t next_frame;	// start of the next USB frame
+static uint16_t frame_nr;
+static uint64_t next_tick = NEVER;	// next SysTick interrupt
+// time of the pending interrupt requests, NEVER if none
+static uint64_t usb_req = NEVER, flash_req = NEVER, tick_req = NEVER;
+
+#define SYST_CSR		0xE000E010
+#define SYST_RVR		0xE000E014
+
+static void Sof(void);
+//-----------------------------------------------------------------------------
+static void Advance(uint64_t t)
+{
+	if (t<=now)
+		return;
+	while (next_frame<=t)
+	{
+		now = next_frame;
+		next_frame += SIM_CYCLES_FRAME;
+		Sof();
+	}
+	now = t;
+	DWT_CYCCNT = (uint32_t)now;
+	if (next_tick<=now)
+	{
+		if (tick_req==NEVER)
+			tick_req = next_tick;
+		while (next_tick<=now)
+			next_tick += CORE_REG(SYST_RVR) + 1;
+	}
+}
+//-----------------------------------------------------------------------------
+uint64_t sim_time(void)
+{
+	return now;
+}
+
+//-----------------------------------------------------------------------------
+// FLASH: erase and program with their timing. The bootloader pages are
+// write protected, so that a misplaced write shows up as WRPRTERR.
+//-----------------------------------------------------------------------------
+static struct {
+	int key;		// KEYR sequence
+	bool busy;
+	bool erase;
+	uint32_t addr;	// page being erased
+	uint64_t end;
+} fl;
+
+static inline uint32_t FlashEnd(void)
+{
+	return SIM_FLASH + cfg.flash_kb * 1024;
+}
+//-----------------------------------------------------------------------------
+static inline uint32_t FlashPageSize(void)
+{
+	return (cfg.flash_kb>128) ? 2048 : 1024;
+}
+//-----------------------------------------------------------------------------
+static void FlashDone(void)
+{
+	if (fl.erase)
+	{
+		memset(flash_mem + (fl.addr - SIM_FLASH), 0xFF, FlashPageSize());
+		sim_stats.erases++;
+	}
+	fl.busy = false;
+	FLASH_REG(FLASH_SR_OFF) = (FLASH_REG(FLASH_SR_OFF) & ~FLASH_SR_BSY) | FLASH_SR_EOP;
+	FLASH_REG(FLASH_CR_OFF) &= ~FLASH_CR_STRT;
+}
+//-----------------------------------------------------------------------------
+// a new operation waits for the running one, like the stalled bus access
+//-----------------------------------------------------------------------------
+static void FlashWait(void)
+{
+	if (fl.busy)
+	{
+		Advance(fl.end);
+		FlashDone();
+	}
+}
+//-----------------------------------------------------------------------------
+static void FlashError(uint32_t sr)
+{
+	FLASH_REG(FLASH_SR_OFF) |= sr;
+	sim_stats.flash_errors++;
+}
+//-----------------------------------------------------------------------------
+static void FlashRegRead(uint32_t addr)
+{
+	if (addr==(FLASH_REG_BASE + FLASH_SR_OFF))
+		FlashWait(); // a busy wait ends with the operation
+}
+//-----------------------------------------------------------------------------
+static void FlashRegWrite(uint32_t addr, uint32_t old)
+{
+	uint32_t off = addr - FLASH_REG_BASE;
+	uint32_t w = FLASH_REG(off);
+	switch (off)
+	{
+	case FLASH_KEYR_OFF:
+		if (w==FLASH_KEY1)
+		{
+			fl.key = 1;
+		}
+		else
+		{
+			if (fl.key==1 && w==FLASH_KEY2)
+				FLASH_REG(FLASH_CR_OFF) &= ~FLASH_CR_LOCK;
+			fl.key = 0;
+		}
+		FLASH_REG(off) = 0;
+		break;
+	case FLASH_SR_OFF: // write 1 to clear
+		FLASH_REG(off) = old & ~(w & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR | FLASH_SR_EOP));
+		break;
+	case FLASH_CR_OFF:
+		if (old & FLASH_CR_LOCK)
+		{	// only the key sequence unlocks
+			FLASH_REG(off) = old;
+			break;
+		}
+		if ( (w & FLASH_CR_STRT) && !(old & FLASH_CR_STRT) && (w & FLASH_CR_PER) )
+		{
+			FlashWait();
+			uint32_t page = FLASH_REG(FLASH_AR_OFF) & ~(FlashPageSize()-1);
+			if ( page<USER_PROGRAM || page>=FlashEnd() )
+			{
+				FLASH_REG(off) = w & ~FLASH_CR_STRT;
+				FlashError(FLASH_SR_WRPRTERR);
+				break;
+			}
+			fl.busy = true;
+			fl.erase = true;
+			fl.addr = page;
+			fl.end = now + cfg.t_erase;
+			FLASH_REG(FLASH_SR_OFF) |= FLASH_SR_BSY;
+		}
+		break;
+	default:
+		break;
+	}
+}
+//-----------------------------------------------------------------------------
+// a halfword store to the flash memory, 'old' is the content before
+//-----------------------------------------------------------------------------
+static void FlashMemWrite(uint32_t addr, uint16_t old)
+{
+	addr &= ~1;
+	uint16_t val = FLASH_MEM16(addr);
+	FLASH_MEM16(addr) = old;
+	FlashWait();
+
+	uint32_t cr = FLASH_REG(FLASH_CR_OFF);
+	if ( (cr & FLASH_CR_LOCK) || !(cr & FLASH_CR_PG) )
+		sim_stats.flash_errors++; // ignored
+	else if ( addr<USER_PROGRAM || addr>=FlashEnd() )
+		FlashError(FLASH_SR_WRPRTERR);
+	else if ( old!=0xFFFF && val!=0 )
+		FlashError(FLASH_SR_PGERR); // not erased
+	else if ( addr==sim_flash_fault.addr && sim_flash_fault.count>0 && sim_flash_fault.stuck==0 )
+	{
+		sim_flash_fault.count--;
+		FlashError(FLASH_SR_PGERR);
+	}
+	else
+	{
+		if ( addr==sim_flash_fault.addr && sim_flash_fault.count>0 )
+		{	// the stuck bits stay erased, the program ends without error
+			sim_flash_fault.count--;
+			val |= sim_flash_fault.stuck;
+		}
+		FLASH_MEM16(addr) = val;
+		fl.busy = true;
+		fl.erase = false;
+		fl.end = now + cfg.t_prog;
+		FLASH_REG(FLASH_SR_OFF) |= FLASH_SR_BSY;
+		sim_stats.programs++;
+	}
+}
+//-----------------------------------------------------------------------------
+static bool FlashIrq(void)
+{
+	uint32_t sr = FLASH_REG(FLASH_SR_OFF), cr = FLASH_REG(FLASH_CR_OFF);
+	return (CORE_REG(0xE000E100) & BIT(NVIC_FLASH)) &&
+		   ( ((cr & FLASH_CR_EOPIE) && (sr & FLASH_SR_EOP)) ||
+			 ((cr & FLASH_CR_ERRIE) && (sr & FLASH_SR_ERRORS)) );
+}
+//-----------------------------------------------------------------------------
+void sim_flash_write(uint32_t addr, const void * data, int len)
+{
+	memcpy(flash_mem + (addr - SIM_FLASH), data, len);
+}
+
+//-----------------------------------------------------------------------------
+// NVIC: set and clear enable registers. SysTick: the interrupt every RVR+1
+// core clocks while ENABLE and TICKINT are set.
+//-----------------------------------------------------------------------------
+static void NvicWrite(uint32_t addr, uint32_t old)
+{
+	uint32_t off = addr - NVIC_PAGE;
+	uint32_t w = CORE_REG(addr);
+	if (addr==SYST_CSR)
+		next_tick = ((w & 3)==3) ? now + CORE_REG(SYST_RVR) + 1 : NEVER;
+	else if (off>=0x100 && off<0x140) // ISER
+		CORE_REG(addr) = old | w;
+	else if (off>=0x180 && off<0x1C0) // ICER
+	{
+		CORE_REG(addr - 0x80) &= ~w;
+		CORE_REG(addr) = CORE_REG(addr - 0x80);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// USB registers
+//-----------------------------------------------------------------------------
+#define EP_TOGGLE_BITS	(DTOG_RX | STAT_RX | DTOG_TX | STAT_TX)
+//-----------------------------------------------------------------------------
+// ISTR: CTR, DIR and EP_ID follow the endpoint with the lowest number
+//-----------------------------------------------------------------------------
+static void IstrUpdate(void)
+{
+	uint32_t istr = ISTR_REG & 0x7F00;
+	for (int r = 0; r < 8; r++)
+	{
+		uint32_t v = EPR(r);
+		if (v & (CTR_RX | CTR_TX))
+		{
+			istr |= CTR | r | ((v & CTR_RX) ? DIR : 0);
+			break;
+		}
+	}
+	ISTR_REG = istr;
+}
+//-----------------------------------------------------------------------------
+static void UsbWrite(uint32_t addr, uint32_t old)
+{
+	if (addr<USB_BASE)
+		return; // another peripheral on this page
+	uint32_t off = (addr & ~3) - USB_BASE;
+	uint32_t w = USB_REG(off);
+	if (off<0x20)
+	{	// EPnR: CTR_x are rc_w0, the toggle bits flip on 1, SETUP is read only
+		uint32_t v = (old & w & (CTR_RX | CTR_TX)) |
+					 ((old ^ w) & EP_TOGGLE_BITS) |
+					 (old & SETUP) |
+					 (w & (EP_TYPE | EP_KIND | MASK_EP));
+		USB_REG(off) = v;
+	}
+	else if (off==0x44) // ISTR: rc_w0
+		ISTR_REG = old & w & 0x7F00;
+	else if (off==0x48) // FNR: read only
+		USB_REG(off) = old;
+	IstrUpdate();
+}
+//-----------------------------------------------------------------------------
+static bool UsbIrq(void)
+{
+	return (CORE_REG(0xE000E100) & BIT(NVIC_USB_LP_CAN_RX0)) && (ISTR_REG & CNTR_REG & 0xFF00);
+}
+//-----------------------------------------------------------------------------
+static void Sof(void)
+{
+	sim_stats.frames++;
+	frame_nr = (frame_nr + 1) & 0x7FF;
+	FNR_REG = (FNR_REG & ~0x7FF) | frame_nr;
+	ISTR_REG |= SOF;
+}
+
+//-----------------------------------------------------------------------------
+// Traps: a faulting access to a protected page is single stepped with the
+// page accessible, the model handles it when the instruction is done.
+//-----------------------------------------------------------------------------
+static struct {
+	uintptr_t page;
+	int prot;
+	uint32_t addr;
+	uint32_t old;
+	bool write;
+} trap;
+
+//-----------------------------------------------------------------------------
+static void OnFault(int sig, siginfo_t * si, void * ctx)
+{
+	ucontext_t * uc = ctx;
+	uintptr_t a = (uintptr_t)si->si_addr;
+	uintptr_t page = a & ~(uintptr_t)(SIM_PAGE-1);
+	bool write = (uc->uc_mcontext.gregs[REG_ERR] & 2)!=0;
+
+	if (a>=SIM_FLASH && a<(SIM_FLASH + SIM_FLASH_SIZE))
+	{
+		trap.prot = PROT_READ;
+		trap.old = FLASH_MEM16(a & ~1);
+	}
+	else if (page==USB_PAGE || page==NVIC_PAGE)
+	{
+		trap.prot = PROT_READ;
+		trap.old = (page==NVIC_PAGE) ? CORE_REG(a & ~3) : PERIPH_REG(a & ~3);
+	}
+	else if (page==FLASH_REG_BASE)
+	{
+		trap.prot = PROT_NONE;
+		if (!write)
+			FlashRegRead(a & ~3);
+		trap.old = PERIPH_REG(a & ~3);
+	}
+	else
+	{	// a real fault, let it crash
+		signal(sig, SIG_DFL);
+		return;
+	}
+	trap.page = page;
+	trap.addr = a;
+	trap.write = write;
+	mprotect((void*)page, SIM_PAGE, PROT_READ | PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= 0x100; // TF
+}
+//-----------------------------------------------------------------------------
+static void OnStep(int sig, siginfo_t * si, void * ctx)
+{
+	(void)sig; (void)si;
+	ucontext_t * uc = ctx;
+	uc->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+	if (trap.page==0)
+		return;
+	mprotect((void*)trap.page, SIM_PAGE, trap.prot);
+	if (trap.write)
+	{
+		if (trap.page<SIM_PERIPH)
+			FlashMemWrite(trap.addr, trap.old);
+		else if (trap.page==USB_PAGE)
+			UsbWrite(trap.addr, trap.old);
+		else if (trap.page==NVIC_PAGE)
+			NvicWrite(trap.addr & ~3, trap.old);
+		else
+			FlashRegWrite(trap.addr & ~3, trap.old);
+	}
+	trap.page = 0;
+}
+
+//-----------------------------------------------------------------------------
+// USB device side of the bus transactions
+//-----------------------------------------------------------------------------
+enum { HS_ACK, HS_NAK, HS_STALL };
+
+// PMA offset to host address, one halfword per 32 bit word
+static inline volatile uint8_t * Pma(int off)
+{
+	return (volatile uint8_t *)(uintptr_t)(USB_RAM + (off & ~1)*2 + (off & 1));
+}
+//-----------------------------------------------------------------------------
+static int EpFind(int addr, bool in)
+{
+	for (int r = 0; r < 8; r++)
+	{
+		uint32_t v = EPR(r);
+		if ( (v & MASK_EP)==(uint32_t)addr && (v & (in ? STAT_TX : STAT_RX)) )
+			return r;
+	}
+	return -1;
+}
+//-----------------------------------------------------------------------------
+// rxCount: BL_SIZE with NUM_BLOCK
+//-----------------------------------------------------------------------------
+static inline int BufSize(uint32_t count)
+{
+	int blocks = (count>>10) & 0x1F;
+	return (count & 0x8000) ? (blocks + 1)*32 : blocks*2;
+}
+//-----------------------------------------------------------------------------
+static int DevOut(int addr, const uint8_t * data, int len, bool setup)
+{
+	int r = EpFind(addr, false);
+	if (r<0)
+		return HS_NAK; // no answer, the host retries
+	uint32_t v = EPR(r);
+	int stat = (v & STAT_RX)>>12;
+	if (!setup)
+	{
+		if (stat==1)
+			return HS_STALL;
+		if (stat==2)
+			return HS_NAK;
+	}
+	bool dbl = (v & EP_KIND) && (v & EP_TYPE)==0;
+	volatile UMEM_FAKEWIDTH * offset = &EpTable[r].rxOffset;
+	volatile UMEM_FAKEWIDTH * count = &EpTable[r].rxCount;
+	if (dbl)
+	{	// the buffer selected by DTOG_RX must not be owned by the application (SW_BUF)
+		if ( !(v & DTOG_RX)==!(v & DTOG_TX) )
+			return HS_NAK;
+		if ( !(v & DTOG_RX) )
+		{
+			offset = &EpTable[r].txOffset;
+			count = &EpTable[r].txCount;
+		}
+	}
+	if ( len>BufSize(*count) )
+	{
+		fprintf(stderr, "sim: packet of %d bytes exceeds the Rx buffer of EP%d\n", len, r);
+		return HS_NAK;
+	}
+	for (int i = 0; i < len; i++)
+		*Pma(*offset + i) = data[i];
+	*count = (*count & ~0x3FF) | len;
+
+	v = (v & ~SETUP) | CTR_RX | (setup ? SETUP : 0);
+	v ^= DTOG_RX;
+	if (!dbl)
+		v = (v & ~STAT_RX) | (2<<12); // NAK until released
+	if (setup)
+		v = (v & ~STAT_TX) | (2<<4);
+	EPR(r) = v;
+	IstrUpdate();
+	return HS_ACK;
+}
+//-----------------------------------------------------------------------------
+// IN token: returns the handshake, the packet is copied to 'data'
+//-----------------------------------------------------------------------------
+static int DevIn(int addr, uint8_t * data, int * len, int * reg)
+{
+	int r = EpFind(addr, true);
+	if (r<0)
+		return HS_NAK;
+	int stat = (EPR(r) & STAT_TX)>>4;
+	if (stat==1)
+		return HS_STALL;
+	if (stat==2)
+		return HS_NAK;
+	int n = EpTable[r].txCount & 0x3FF;
+	int off = EpTable[r].txOffset;
+	for (int i = 0; i < n; i++)
+		data[i] = *Pma(off + i);
+	*len = n;
+	*reg = r;
+	return HS_ACK;
+}
+//-----------------------------------------------------------------------------
+// the host acknowledged the IN packet
+//-----------------------------------------------------------------------------
+static void DevInDone(int r)
+{
+	uint32_t v = EPR(r);
+	v = (v & ~STAT_TX) | (2<<4) | CTR_TX;
+	v ^= DTOG_TX;
+	EPR(r) = v;
+	IstrUpdate();
+}
+
+//-----------------------------------------------------------------------------
+// USB host: bulk OUT queue, bulk IN buffer, control transfers
+//-----------------------------------------------------------------------------
+typedef struct packet_t {
+	int len;
+	uint8_t data[EP_DATA_LEN];
+} packet_t;
+
+static packet_t * out_q;
+static int out_head, out_tail, out_cap;
+
+static uint8_t * in_buf;
+static int in_head, in_len, in_cap;
+
+enum { CTRL_IDLE, CTRL_SETUP, CTRL_DATA_IN, CTRL_DATA_OUT, CTRL_STATUS_IN, CTRL_STATUS_OUT, CTRL_DONE, CTRL_STALL };
+static struct {
+	int state;
+	uint8_t setup[8];
+	uint8_t * data;
+	int len; // wLength
+	int pos;
+} ctrl;
+
+//-----------------------------------------------------------------------------
+void sim_out(const void * data, int len)
+{
+	const uint8_t * src = data;
+	do {
+		if (out_tail==out_cap)
+		{
+			if (out_head)
+			{
+				memmove(out_q, out_q + out_head, (out_tail - out_head) * sizeof(packet_t));
+				out_tail -= out_head;
+				out_head = 0;
+			}
+			else
+			{
+				out_cap = out_cap ? out_cap*2 : 256;
+				out_q = realloc(out_q, out_cap * sizeof(packet_t));
+			}
+			continue;
+		}
+		int n = (len>EP_DATA_LEN) ? EP_DATA_LEN : len;
+		out_q[out_tail].len = n;
+		memcpy(out_q[out_tail].data, src, n);
+		out_tail++;
+		src += n;
+		len -= n;
+	} while (len>0);
+}
+//-----------------------------------------------------------------------------
+int sim_out_pending(void)
+{
+	return out_tail - out_head;
+}
+//-----------------------------------------------------------------------------
+void sim_out_cancel(void)
+{
+	out_head = out_tail = 0;
+}
+//-----------------------------------------------------------------------------
+static void InPut(const uint8_t * data, int len)
+{
+	if (in_head)
+	{
+		memmove(in_buf, in_buf + in_head, in_len - in_head);
+		in_len -= in_head;
+		in_head = 0;
+	}
+	if (in_len + len>in_cap)
+	{
+		in_cap = (in_cap + len)*2;
+		in_buf = realloc(in_buf, in_cap);
+	}
+	memcpy(in_buf + in_len, data, len);
+	in_len += len;
+}
+//-----------------------------------------------------------------------------
+int sim_in_count(void)
+{
+	return in_len - in_head;
+}
+//-----------------------------------------------------------------------------
+int sim_in(void * buf, int len)
+{
+	if (len>sim_in_count())
+		len = sim_in_count();
+	memcpy(buf, in_buf + in_head, len);
+	in_head += len;
+	return len;
+}
+
+//-----------------------------------------------------------------------------
+// Full speed bus: a transaction is scheduled into the current frame if it
+// fits before the end of frame, else into the next one after the SOF.
+// Bit times: token 4 bytes, data packet len+4 bytes (SYNC, PID, CRC16),
+// handshake 2 bytes, plus EOPs and turnaround.
+//-----------------------------------------------------------------------------
+#define BITS_DATA(n)	(((n) + 10)*8 + 25)
+#define BITS_IN_NAK		(6*8 + 20)
+#define BITS_SOF		(4*8 + 8)
+#define BITS_EOF		32
+
+enum { OP_NONE, OP_OUT, OP_IN, OP_SETUP, OP_CTRL_OUT, OP_CTRL_IN, OP_STATUS_OUT, OP_STATUS_IN };
+static struct {
+	int op;
+	int hs;		// IN: handshake at the token
+	int reg;	// IN: EP register
+	int len;
+	uint8_t data[EP_DATA_LEN];
+	uint64_t end;
+	uint64_t bits;
+	bool in_turn; // bulk: IN and OUT in turn
+} bus;
+static uint64_t bus_free;
+
+static inline bool InReady(void)
+{
+	int r = EpFind(EP_DATA, true);
+	return r>=0 && ((EPR(r) & STAT_TX)>>4)==3;
+}
+//-----------------------------------------------------------------------------
+static bool BusWork(void)
+{
+	return (ctrl.state>CTRL_IDLE && ctrl.state<CTRL_DONE) || sim_out_pending() || InReady();
+}
+//-----------------------------------------------------------------------------
+static uint64_t BusStartTime(void)
+{
+	uint64_t t = (now>bus_free) ? now : bus_free;
+	uint64_t frame = t / SIM_CYCLES_FRAME * SIM_CYCLES_FRAME;
+	if ( t<(frame + BITS_SOF*SIM_BIT_CYCLES) )
+		t = frame + BITS_SOF*SIM_BIT_CYCLES;
+	if ( (t + BITS_DATA(EP_DATA_LEN)*SIM_BIT_CYCLES)>(frame + SIM_CYCLES_FRAME - BITS_EOF*SIM_BIT_CYCLES) )
+		t = frame + SIM_CYCLES_FRAME + BITS_SOF*SIM_BIT_CYCLES;
+	return t;
+}
+//-----------------------------------------------------------------------------
+static void BusStart(void)
+{
+	bus.len = 0;
+	bus.hs = HS_ACK;
+	switch (ctrl.state)
+	{
+	case CTRL_SETUP:
+		bus.op = OP_SETUP;
+		bus.len = 8;
+		memcpy(bus.data, ctrl.setup, 8);
+		break;
+	case CTRL_DATA_OUT:
+		bus.op = OP_CTRL_OUT;
+		bus.len = (ctrl.len - ctrl.pos>EP_DATA_LEN) ? EP_DATA_LEN : (ctrl.len - ctrl.pos);
+		memcpy(bus.data, ctrl.data + ctrl.pos, bus.len);
+		break;
+	case CTRL_STATUS_OUT:
+		bus.op = OP_STATUS_OUT;
+		break;
+	case CTRL_DATA_IN:
+	case CTRL_STATUS_IN:
+		bus.op = (ctrl.state==CTRL_DATA_IN) ? OP_CTRL_IN : OP_STATUS_IN;
+		bus.hs = DevIn(EP_CTRL, bus.data, &bus.len, &bus.reg);
+		break;
+	default:
+		if ( sim_out_pending() && !(bus.in_turn && InReady()) )
+		{
+			bus.op = OP_OUT;
+			bus.len = out_q[out_head].len;
+		}
+		else
+		{
+			bus.op = OP_IN;
+			bus.hs = DevIn(EP_DATA, bus.data, &bus.len, &bus.reg);
+		}
+		bus.in_turn = (bus.op==OP_OUT);
+		break;
+	}
+	bool in = (bus.op==OP_IN || bus.op==OP_CTRL_IN || bus.op==OP_STATUS_IN);
+	bus.bits = (in && bus.hs!=HS_ACK) ? BITS_IN_NAK : BITS_DATA(bus.len);
+	bus.end = now + bus.bits*SIM_BIT_CYCLES;
+	bus_free = bus.end;
+}
+//-----------------------------------------------------------------------------
+static void CtrlHandshake(int hs, int next)
+{
+	if (hs==HS_STALL)
+		ctrl.state = CTRL_STALL;
+	else if (hs==HS_ACK)
+		ctrl.state = next;
+}
+//-----------------------------------------------------------------------------
+static void BusDone(void)
+{
+	int hs;
+	switch (bus.op)
+	{
+	case OP_SETUP:
+		sim_stats.setups++;
+		DevOut(EP_CTRL, bus.data, 8, true);
+		ctrl.state = (ctrl.len==0) ? CTRL_STATUS_IN : (ctrl.setup[0] & 0x80) ? CTRL_DATA_IN : CTRL_DATA_OUT;
+		break;
+	case OP_CTRL_OUT:
+		hs = DevOut(EP_CTRL, bus.data, bus.len, false);
+		if (hs==HS_ACK)
+			ctrl.pos += bus.len;
+		CtrlHandshake(hs, (ctrl.pos<ctrl.len) ? CTRL_DATA_OUT : CTRL_STATUS_IN);
+		break;
+	case OP_STATUS_OUT:
+		CtrlHandshake(DevOut(EP_CTRL, NULL, 0, false), CTRL_DONE);
+		break;
+	case OP_CTRL_IN:
+		if (bus.hs==HS_ACK)
+		{
+			DevInDone(bus.reg);
+			int n = (bus.len<(ctrl.len - ctrl.pos)) ? bus.len : (ctrl.len - ctrl.pos);
+			memcpy(ctrl.data + ctrl.pos, bus.data, n);
+			ctrl.pos += n;
+		}
+		CtrlHandshake(bus.hs, (bus.len<EP_DATA_LEN || ctrl.pos>=ctrl.len) ? CTRL_STATUS_OUT : CTRL_DATA_IN);
+		break;
+	case OP_STATUS_IN:
+		if (bus.hs==HS_ACK)
+			DevInDone(bus.reg);
+		CtrlHandshake(bus.hs, CTRL_DONE);
+		break;
+	case OP_OUT:
+		hs = DevOut(EP_DATA, out_q[out_head].data, bus.len, false);
+		if (hs==HS_ACK)
+		{
+			out_head++;
+			sim_stats.out_packets++;
+			sim_stats.out_bytes += bus.len;
+		}
+		else if (hs==HS_NAK)
+		{
+			sim_stats.out_naks++;
+			sim_stats.nak_cycles += bus.bits*SIM_BIT_CYCLES;
+		}
+		else
+		{
+			fprintf(stderr, "sim: EP_DATA OUT stalled, packet dropped\n");
+			out_head++;
+		}
+		break;
+	case OP_IN:
+		if (bus.hs==HS_ACK)
+		{
+			DevInDone(bus.reg);
+			InPut(bus.data, bus.len);
+			sim_stats.in_packets++;
+		}
+		break;
+	}
+	bus.op = OP_NONE;
+}
+
+//-----------------------------------------------------------------------------
+// Scheduler
+//-----------------------------------------------------------------------------
+// notes the time of the new interrupt requests
+static void Requests(void)
+{
+	if ( usb_req==NEVER && UsbIrq() )
+		usb_req = now;
+	if ( flash_req==NEVER && FlashIrq() )
+		flash_req = now;
+}
+//-----------------------------------------------------------------------------
+// The code of the handler runs from SRAM if it is in the section of __ramfunc
+// (host build with RAM_CODE). Else its first fetch stalls until the running
+// flash operation is done, the bus stands still meanwhile like in a blocking
+// flash wait. Counts the latency of the request.
+//-----------------------------------------------------------------------------
+extern const char __start_ramfunc[] __attribute__((weak));
+extern const char __stop_ramfunc[] __attribute__((weak));
+
+static void Enter(void (*handler)(void), uint64_t * req)
+{
+	const char * code = (const char *)handler;
+	if ( fl.busy && !(code>=__start_ramfunc && code<__stop_ramfunc) )
+	{
+		sim_stats.flash_stalls++;
+		FlashWait();
+	}
+	if ( *req!=NEVER && now - *req > sim_stats.irq_latency )
+		sim_stats.irq_latency = now - *req;
+	*req = NEVER;
+}
+//-----------------------------------------------------------------------------
+// Serves the pending interrupts, else runs the main loop once.
+// The USB ISR takes the CPU for cfg.isr_cycles, the bus goes on meanwhile.
+//-----------------------------------------------------------------------------
+static void CpuStep(void)
+{
+	while (now>=cpu_free)
+	{
+		Requests();
+#if RAM_CODE
+		if ( FlashIrq() )
+		{
+			sim_stats.flash_irqs++;
+			Enter(FLASH_IRQHandler, &flash_req);
+			FLASH_IRQHandler();
+		}
+		else
+#endif
+		if (tick_req!=NEVER)
+		{	// same priority as the USB ISR, the lower exception number goes first
+			Enter(SysTick_Handler, &tick_req);
+			SysTick_Handler();
+		}
+		else if ( UsbIrq() )
+		{
+			Enter(NAME_OF_USB_IRQ_HANDLER, &usb_req);
+			sim_stats.usb_irqs++;
+			sim_stats.isr_cycles += cfg.isr_cycles;
+			cpu_free = now + cfg.isr_cycles;
+			NAME_OF_USB_IRQ_HANDLER();
+		}
+		else
+		{
+			yield();
+			break;
+		}
+	}
+}
+//-----------------------------------------------------------------------------
+static bool Idle(void)
+{
+	return !bus.op && !BusWork() && !fl.busy && now>=cpu_free && !FlashIrq() && !UsbIrq() && tick_req==NEVER;
+}
+//-----------------------------------------------------------------------------
+static uint64_t NextEvent(void)
+{
+	uint64_t t = NEVER;
+	if (bus.op)
+		t = bus.end;
+	else if ( BusWork() )
+		t = BusStartTime();
+	if ( fl.busy && fl.end<t )
+		t = fl.end;
+	if ( now<cpu_free && cpu_free<t )
+		t = cpu_free;
+	if ( (CNTR_REG & SOFM) && next_frame<t )
+		t = next_frame;
+	if (next_tick<t)
+		t = next_tick;
+	return t;
+}
+//-----------------------------------------------------------------------------
+static void RunEvent(uint64_t t)
+{
+	Advance(t);
+	if ( fl.busy && fl.end<=now )
+		FlashDone();
+	if ( bus.op && bus.end<=now )
+		BusDone();
+	else if ( !bus.op && BusWork() && BusStartTime()<=now )
+		BusStart();
+	Requests();
+}
+//-----------------------------------------------------------------------------
+bool sim_run(bool (*done)(void), uint64_t timeout)
+{
+	uint64_t limit = now + timeout;
+	for (;;)
+	{
+		CpuStep();
+		if ( done ? done() : Idle() )
+			return true;
+		uint64_t t = NextEvent();
+		if (t>limit)
+		{
+			Advance(limit);
+			return done ? done() : Idle();
+		}
+		RunEvent(t);
+	}
+}
+//-----------------------------------------------------------------------------
+static bool CtrlFinished(void)
+{
+	return ctrl.state>=CTRL_DONE;
+}
+//-----------------------------------------------------------------------------
+int sim_control(const void * setup, void * data)
+{
+	memcpy(ctrl.setup, setup, 8);
+	ctrl.data = data;
+	ctrl.len = ctrl.setup[6] | (ctrl.setup[7]<<8);
+	ctrl.pos = 0;
+	ctrl.state = CTRL_SETUP;
+	bool ok = sim_run(CtrlFinished, 100 * SIM_CYCLES_FRAME);
+	int ret = (ok && ctrl.state==CTRL_DONE) ? ctrl.pos : -1;
+	ctrl.state = CTRL_IDLE;
+	return ret;
+}
+
+//-----------------------------------------------------------------------------
+// Setup
+//-----------------------------------------------------------------------------
+static uint8_t * Map(uintptr_t addr, size_t size, bool alias)
+{
+	int fd = memfd_create("sim", 0);
+	if ( fd<0 || ftruncate(fd, size)<0 )
+		goto fail;
+	void * p = mmap((void*)addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	if (p!=(void*)addr)
+		goto fail;
+	if (alias)
+	{
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p==MAP_FAILED)
+			goto fail;
+	}
+	close(fd);
+	return p;
+fail:
+	fprintf(stderr, "sim: can not map 0x%08lx, link with -no-pie\n", (unsigned long)addr);
+	exit(2);
+}
+//-----------------------------------------------------------------------------
+static bool ResetDone(void)
+{
+	return !(ISTR_REG & RESET);
+}
+//-----------------------------------------------------------------------------
+void sim_init(const sim_config_t * config)
+{
+	static const sim_config_t def = SIM_CONFIG_DEFAULT;
+	cfg = config ? *config : def;
+
+	flash_mem = Map(SIM_FLASH, SIM_FLASH_SIZE, true);
+	Map(SIM_SYS, SIM_PAGE, false);
+	periph = Map(SIM_PERIPH, SIM_PERIPH_SIZE, true);
+	Map(SIM_BITBAND, SIM_BITBAND_SIZE, false);
+	core = Map(SIM_CORE, SIM_CORE_SIZE, true);
+
+	memset(flash_mem, 0xFF, SIM_FLASH_SIZE);
+	FLASH_SIZE_REG = cfg.flash_kb;
+	FLASH_REG(FLASH_CR_OFF) = FLASH_CR_LOCK;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = OnFault;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = OnStep;
+	sigaction(SIGTRAP, &sa, NULL);
+
+	mprotect((void*)SIM_FLASH, SIM_FLASH_SIZE, PROT_READ);
+	mprotect((void*)USB_PAGE, SIM_PAGE, PROT_READ);
+	mprotect((void*)FLASH_REG_BASE, SIM_PAGE, PROT_NONE);
+	mprotect((void*)NVIC_PAGE, SIM_PAGE, PROT_READ);
+
+	now = cpu_free = bus_free = 0;
+	next_frame = SIM_CYCLES_FRAME;
+	Main_init();
+
+	// bus reset, then the enumeration as far as the bootloader needs it
+	ISTR_REG |= RESET;
+	IstrUpdate();
+	sim_run(ResetDone, SIM_CYCLES_FRAME);
+	static const uint8_t set_address[8] = { 0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	static const uint8_t set_configuration[8] = { 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	if ( sim_control(set_address, NULL)<0 || sim_control(set_configuration, NULL)<0 )
+	{
+		fprintf(stderr, "sim: enumeration failed\n");
+		exit(2);
+	}
+	memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+//-----------------------------------------------------------------------------
+// Stubs for the parts of the firmware which are not simulated
+//-----------------------------------------------------------------------------
+uint32_t g_pfnVectors[76]; // startup_stm32.S
+//-----------------------------------------------------------------------------
+void nvic_set_vector_table(uint32 address, uint32 offset)
+{
+	(void)address; (void)offset;
+}
+//-----------------------------------------------------------------------------
+void _fail(const char * file, int line, const char * exp)
+{
+	fprintf(stderr, "sim: assertion %s failed at %s:%d\n", exp, file, line);
+	abort();
+}
@@ -0,0 +1,126 @@
+/*
+ * sim.h
+ *
+ * Host simulation of the bootloader (Linux x86-64).
+ *
+ * The firmware sources are compiled for the host unchanged and run against
+ * emulated peripherals at their real addresses: the flash memory, the flash
+ * size register, the USB registers with the packet memory (PMA), the FLASH
+ * register map and the core registers (DWT, NVIC, SysTick). The memory is
+ * mapped at the fixed addresses, so the binary must be linked with -no-pie.
+ *
+ * Register writes with side effects are caught by write protection: the
+ * faulting store is single stepped and the peripheral model applies the
+ * hardware semantics afterwards (rc_w0 and toggle bits of the USB registers,
+ * the flash key sequence, erase and program with their timing). Reads of
+ * FLASH_SR are caught as well, a busy wait jumps to the end of the operation.
+ * The bootloader pages are write protected, a stray write sets WRPRTERR.
+ *
+ * Time is counted in core clocks (F_CPU) and drives DWT_CYCCNT. Firmware code
+ * takes no simulated time, except the USB ISR which is charged a fixed cost
+ * per call (sim_config_t.isr_cycles). The host side is a full speed frame
+ * scheduler: 1 ms frames, a transaction occupies the bus for the bit time of
+ * its packets and must end before the end of the frame. A NAKed OUT still
+ * carries its data packet. Control transfers go first, then bulk OUT and IN
+ * in turn, IN only when the device has data. Interrupts are served between
+ * the simulation steps, a blocking flash wait in yield() also blocks the bus.
+ * SysTick interrupts every 1 ms. With RAM_CODE the __ramfunc code goes to a
+ * section of its own: an interrupt handler outside of it waits for the
+ * running flash operation, like a fetch from the busy flash.
+ * The CRC unit is not modelled, build with CRC_HW=0.
+ *
+ * Build and run the functional tests (from the repository root):
+ *   CFLAGS="-std=gnu11 -O1 -no-pie -DF_CPU=72000000 -DMCU_STM32F103C8 -DCRC_HW=0 \
+ *           -Isrc -Isrc/libmaple -Itest"
+ *   SRC="src/usb.c src/usb_desc.c src/crc.c src/lz.c src/evt.c src/prof.c \
+ *        src/system.c src/libmaple/flash.c src/libmaple/gpio.c src/libmaple/rcc.c \
+ *        src/libmaple/rcc_f1.c src/libmaple/systick.c test/sim.c test/host.c"
+ *   gcc $CFLAGS -Dmain=bootloader_main -c src/main.c -o sim_main.o
+ *   gcc $CFLAGS sim_main.o $SRC test/sim_test.c -o sim_test && ./sim_test
+ * This tests the default build. The tests of the options run when they are
+ * added to CFLAGS, e.g. all of them:
+ *   -DUPLOAD_V2=1 -DUPLOAD_LZ=1 -DUPLOAD_DIRECT=1 -DUPLOAD_MANIFEST=1 -DFLASH_DUMP=1
+ *   -DFLASH_TIMING=1 -DUSB_STATS=1 -DFLASH_STATS=1 -DRAM_CODE=1 -DEP_DATA_DBL_BUF=1
+ * With RAM_CODE the flash operations run asynchronously on the flash interrupt.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_CYCLES_US		(F_CPU / 1000000) // core clocks per us
+#define SIM_CYCLES_FRAME	(F_CPU / 1000) // full speed frame
+#define SIM_BIT_CYCLES		6 // 72 MHz / 12 Mbit/s
+
+typedef struct sim_config_t {
+	uint16_t flash_kb;		// flash size register, 64 .. 512
+	uint32_t t_erase;		// page erase, core clocks
+	uint32_t t_prog;		// halfword program, core clocks
+	uint32_t isr_cycles;	// charged per call of the USB ISR
+} sim_config_t;
+
+// datasheet typical values of the STM32F103
+#define SIM_CONFIG_DEFAULT	{ .flash_kb = 64, .t_erase = 20000 * SIM_CYCLES_US, .t_prog = 52 * SIM_CYCLES_US, .isr_cycles = 10 * SIM_CYCLES_US }
+
+// counters of the simulated hardware since sim_init()
+typedef struct sim_stats_t {
+	uint32_t frames;		// SOFs
+	uint32_t setups;
+	uint32_t out_packets;	// bulk OUT packets accepted
+	uint32_t out_naks;
+	uint32_t in_packets;	// bulk IN packets received
+	uint64_t out_bytes;
+	uint64_t nak_cycles;	// bus time of NAKed OUT transactions
+	uint64_t isr_cycles;	// charged USB ISR time
+	uint32_t usb_irqs;
+	uint32_t flash_irqs;
+	uint32_t erases;		// pages
+	uint32_t programs;		// halfwords
+	uint32_t flash_errors;	// program of a not erased halfword, locked or misplaced writes, injected PGERR
+	uint64_t irq_latency;	// longest time from an interrupt request to its handler, core clocks
+	uint32_t flash_stalls;	// handlers fetched from flash while it was busy, see CpuStep()
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+// Maps the memory, erases the flash, runs Main_init() and enumerates the device.
+// cfg may be NULL for SIM_CONFIG_DEFAULT. Can be called once per process.
+extern void sim_init(const sim_config_t * cfg);
+
+// core clocks since sim_init()
+extern uint64_t sim_time(void);
+
+// writes the flash content directly, no timing, e.g. to preset an old image
+extern void sim_flash_write(uint32_t addr, const void * data, int len);
+
+// flash fault injection: the next 'count' programs of the halfword at addr fail
+typedef struct sim_flash_fault_t {
+	uint32_t addr;
+	uint16_t stuck;		// bits which stay erased, 0: the program ends with PGERR
+	int count;
+} sim_flash_fault_t;
+
+extern sim_flash_fault_t sim_flash_fault;
+
+// Control transfer on EP0. Returns the length of the data stage,
+// or -1 if the device stalled or did not answer in time.
+extern int sim_control(const void * setup, void * data);
+
+// queues bulk OUT data, sent as packets of EP_DATA_LEN bytes and a short one
+extern void sim_out(const void * data, int len);
+// bulk OUT packets not accepted yet
+extern int sim_out_pending(void);
+// drops them, like a cancelled transfer
+extern void sim_out_cancel(void);
+
+// Bulk IN data received from the device. sim_in() takes up to len bytes.
+extern int sim_in_count(void);
+extern int sim_in(void * buf, int len);
+
+// Runs yield(), the interrupts and the bus until done() returns true (NULL:
+// until the bus is idle) or timeout core clocks have passed. Returns done().
+extern bool sim_run(bool (*done)(void), uint64_t timeout);
+
+#endif // SIM_H
@@ -0,0 +1,562 @@
+/*
+ * sim_test.c
+ *
+ * Functional tests of the bootloader on the host simulation (sim.h).
+ * Each test runs in its own process on a freshly initialized device.
+ * Build and run: see sim.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "host.h"
+
+extern int flash_complete;
+
+#define CHECK(cond)	do { if (!(cond)) { fprintf(stderr, "  %s:%d: %s\n", __FILE__, __LINE__, #cond); return false; } } while (0)
+
+static uint8_t img[256 * 1024];
+static info_t info;
+
+//-----------------------------------------------------------------------------
+#define MakeImage(seed, len)	host_image(seed, img, len)
+//-----------------------------------------------------------------------------
+static bool FlashEquals(uint32_t addr, const uint8_t * data, int len)
+{
+	return memcmp((void*)(uintptr_t)addr, data, len)==0;
+}
+
+//-----------------------------------------------------------------------------
+// Tests
+//-----------------------------------------------------------------------------
+static bool TestDescriptor(void)
+{
+	static const uint8_t get_device[8] = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 18, 0x00 };
+	uint8_t desc[18];
+	CHECK( sim_control(get_device, desc)==18 );
+	CHECK( desc[0]==18 && desc[1]==1 );
+	return true;
+}
+#if USB_STATS
+//-----------------------------------------------------------------------------
+static bool TestVendorStats(void)
+{
+	static const uint8_t get_stats[8] = { 0xC0, VENDOR_REQ_STATS, 0, 0, 0, 0, 0xFF, 0x00 };
+	usb_stats_t st;
+	CHECK( sim_control(get_stats, &st)==sizeof(usb_stats_t) );
+	CHECK( st.size==sizeof(usb_stats_t) );
+	return true;
+}
+#endif
+#if USB_SOF_STATS && UPLOAD_V2
+//-----------------------------------------------------------------------------
+// the snapshot takes more than one packet of the control EP
+//-----------------------------------------------------------------------------
+static bool TestFrames(void)
+{
+	static const uint8_t get_frames[8] = { 0xC0, VENDOR_REQ_FRAMES, 0, 0, 0, 0, 0xFF, 0x00 };
+	frame_stats_t fs;
+	MakeImage(9, 4096);
+	CHECK( host_stream(img, USER_PROGRAM, 4096, 0).err==NO_ERROR );
+	CHECK( sim_control(get_frames, &fs)==sizeof(frame_stats_t) );
+	CHECK( fs.frames>0 && fs.out_packets>0 && fs.out_packets<=sim_stats.out_packets ); // from the first SOF
+	uint32_t sum = 0;
+	for (int i = 0; i < FRAME_HIST; i++)
+		sum += fs.hist[i];
+	CHECK( sum==fs.frames );
+	return true;
+}
+#endif
+//-----------------------------------------------------------------------------
+static bool TestV1(void)
+{
+	int len = 5*1024 + 300;
+	MakeImage(1, len);
+	CHECK( host_v1(img, len) );
+	CHECK( sim_run(NULL, HOST_TIMEOUT) );
+	CHECK( flash_complete );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	return true;
+}
+//-----------------------------------------------------------------------------
+// 2 KB flash pages: two v1 pages share a staging buffer, the odd last page is
+// committed half filled and the rest of its flash page is erased
+//-----------------------------------------------------------------------------
+static bool TestV1Pages2K(void)
+{
+	int len = 4*1024 + 300;
+	MakeImage(13, len);
+	uint8_t old[2048];
+	memset(old, 0, sizeof(old));
+	sim_flash_write(USER_PROGRAM + 4*1024, old, sizeof(old));
+	CHECK( host_v1(img, len) );
+	CHECK( sim_run(NULL, HOST_TIMEOUT) );
+	CHECK( flash_complete );
+	CHECK( sim_stats.erases==3 );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	memset(old, 0xFF, sizeof(old));
+	CHECK( FlashEquals(USER_PROGRAM + len, old, 6*1024 - len) );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestV1TooLarge(void)
+{	// one page more than the flash holds is refused, the next upload starts over
+	uint8_t msg[64];
+	host_cmd(CMD_ID_NUM_PAGES, (64*1024 - BOOTLOADER_SIZE)/PAGE_SIZE + 1, 0);
+	CHECK( host_msg(msg)==sizeof(error_t) && msg[0]==CMD_WRONG_ADDRESS );
+	return TestV1();
+}
+#if RAM_CODE
+//-----------------------------------------------------------------------------
+// The interrupt handlers run from SRAM, so an erase does not delay them:
+// SysTick every 1 ms and the USB ISR for the packets of the next page.
+//-----------------------------------------------------------------------------
+static bool TestIrqLatency(void)
+{
+	int len = 6*1024;
+	MakeImage(12, len);
+	CHECK( host_v1(img, len) );
+	CHECK( sim_run(NULL, HOST_TIMEOUT) );
+	CHECK( flash_complete );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	CHECK( sim_stats.erases==6 );
+	CHECK( sim_stats.flash_stalls==0 );
+	CHECK( sim_stats.irq_latency<=10*SIM_CYCLES_US ); // one USB ISR at most, not tERASE
+	return true;
+}
+#endif
+#if EP_DATA_DBL_BUF && RAM_CODE
+//-----------------------------------------------------------------------------
+// While a packet is held in one Rx buffer, the hardware ACKs the next one into
+// the other buffer, only the third is NAKed. The v1 headers are sent without
+// waiting for the echo, so that the staging queue gets full during the erase.
+//-----------------------------------------------------------------------------
+extern volatile int rx_pending, rx_skipped;
+
+static bool Held(void)
+{
+	return rx_pending && rx_skipped;
+}
+static bool TestDoubleBuffer(void)
+{
+	int pages = 4, len = pages*1024;
+	MakeImage(11, len);
+	uint8_t msg[64];
+	host_cmd(CMD_ID_NUM_PAGES, pages, 0);
+	CHECK( host_msg(msg)==sizeof(cmd_t) && msg[2]==CMD_ID_NUM_PAGES );
+	for (int i = 0; i < pages; i++)
+	{
+		host_cmd(CMD_ID_PAGE, i, 1024);
+		sim_out(img + i*1024, 1024);
+	}
+	CHECK( sim_run(Held, HOST_TIMEOUT) );
+	uint32_t acked = sim_stats.out_packets, naks = sim_stats.out_naks;
+	sim_run(NULL, 2*SIM_CYCLES_FRAME);
+	CHECK( rx_pending && rx_skipped ); // still held by the erase
+	CHECK( sim_stats.out_packets==acked && sim_stats.out_naks>naks );
+
+	CHECK( sim_run(NULL, HOST_TIMEOUT) );
+	CHECK( flash_complete );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	return true;
+}
+#endif
+#if UPLOAD_V2
+//-----------------------------------------------------------------------------
+static bool TestInfo(void)
+{
+	CHECK( info.flash_size==64*1024 );
+	CHECK( info.page_size==1024 );
+	CHECK( info.user_start==USER_PROGRAM );
+	CHECK( info.pages==(64 - BOOTLOADER_SIZE/1024) );
+	CHECK( info.session_flags==SESSION_SUPPORTED );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool Stream(uint8_t flags, int len)
+{
+	MakeImage(2, len);
+	host_result_t res = host_stream(img, USER_PROGRAM, len, flags);
+	CHECK( res.flags==flags );
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.pages==(len + info.page_size - 1)/info.page_size );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	CHECK( sim_stats.flash_errors==0 );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestStream(void)		{ return Stream(0, 20000); }
+#if UPLOAD_LZ
+static bool TestCompressed(void)	{ return Stream(SESSION_COMPRESSED, 20000); }
+#endif
+#if UPLOAD_DIRECT
+static bool TestDirect(void)		{ return Stream(SESSION_DIRECT | SESSION_VERIFY, 20001); }
+#endif
+static bool TestPageCrc(void)		{ return Stream(SESSION_PAGE_CRC, 20000); }
+//-----------------------------------------------------------------------------
+static bool TestWindowed(void)
+{
+	int len = 20000;
+	MakeImage(3, len);
+	host_result_t res = host_windowed(img, USER_PROGRAM, len, SESSION_WINDOWED | SESSION_VERIFY, NULL);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.naks==0 );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	return true;
+}
+//-----------------------------------------------------------------------------
+// windowed upload of FAULTY_LEN with a fault injected into frame 'seq'
+//-----------------------------------------------------------------------------
+#define FAULTY_LEN		20000
+#define FAULTY_DONE()	( FlashEquals(USER_PROGRAM, img, FAULTY_LEN) && sim_stats.erases==20 )
+
+static host_result_t Faulty(host_fault_kind_t kind, uint16_t seq)
+{
+	MakeImage(9, FAULTY_LEN);
+	host_fault.kind = kind;
+	host_fault.seq = seq;
+	return host_windowed(img, USER_PROGRAM, FAULTY_LEN, SESSION_WINDOWED, NULL);
+}
+//-----------------------------------------------------------------------------
+static bool TestLostPacket(void)
+{	// the header of frame 4 shows frame 3 incomplete
+	host_result_t res = Faulty(HOST_DROP_PACKET, 3);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.naks==1 && res.nak_seq==3 && res.nak_err==DATA_UNDEFLOW );
+	CHECK( res.resent==1 );
+	CHECK( FAULTY_DONE() );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestBadFrameCrc(void)
+{	// the header is dropped, the ACKs report frame 3 missing below the written ones
+	host_result_t res = Faulty(HOST_BAD_CRC, 3);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.naks==1 && res.nak_seq==0xFFFF && res.nak_err==CMD_WRONG_CRC );
+	CHECK( res.sack_seq==3 && (res.sack_bitmap & 1) );
+	CHECK( res.resent==1 );
+	CHECK( FAULTY_DONE() );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestBadFrameData(void)
+{
+	host_result_t res = Faulty(HOST_BAD_DATA, 3);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.naks==1 && res.nak_seq==3 && res.nak_err==IMAGE_WRONG_CHECKSUM );
+	CHECK( res.resent==1 );
+	CHECK( FAULTY_DONE() );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestOutOfWindow(void)
+{	// frame 8 ahead of frame 0 is refused, it is sent again when the window opens
+	host_result_t res = Faulty(HOST_OUT_OF_WINDOW, UPLOAD_WINDOW);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.naks==1 && res.nak_seq==UPLOAD_WINDOW && res.nak_err==NO_FREE_BUFFER );
+	CHECK( res.resent==0 );
+	CHECK( FAULTY_DONE() );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestDuplicate(void)
+{	// the copy is dropped, the page is written once
+	host_result_t res = Faulty(HOST_DUPLICATE, 3);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.naks==0 && res.resent==0 && res.sack_bitmap==0 );
+	CHECK( FAULTY_DONE() );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestFlashFaultWindowed(void)
+{	// a stuck bit fails the verify of page 3, the resent frame is written again
+	int len = 20000;
+	MakeImage(10, len);
+	img[3*1024 + 0x106] = 0x5A;
+	sim_flash_fault = (sim_flash_fault_t){ USER_PROGRAM + 3*1024 + 0x106, 0x0001, 1 };
+	host_result_t res = host_windowed(img, USER_PROGRAM, len, SESSION_WINDOWED | SESSION_VERIFY, NULL);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.naks==1 && res.nak_err==FLASH_VERIFY_ERROR && res.nak_seq==3 && res.nak_offset==0x106 );
+	CHECK( res.resent==1 && sim_stats.erases==21 );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+
+	// PGERR in page 5
+	MakeImage(11, len);
+	img[5*1024 + 0x20] = 0x12;
+	sim_flash_fault = (sim_flash_fault_t){ USER_PROGRAM + 5*1024 + 0x20, 0, 1 };
+	res = host_windowed(img, USER_PROGRAM, len, SESSION_WINDOWED, NULL);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.naks==1 && res.nak_err==FLASH_PROGRAM_ERROR && res.nak_seq==5 && res.nak_offset==0x20 );
+	CHECK( res.resent==1 );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestFlashFaultStream(void)
+{	// a stream can not resend a page, it ends with the failed page and offset
+	int len = 20000;
+	MakeImage(12, len);
+	img[5*1024 + 0x20] = 0x12;
+	sim_flash_fault = (sim_flash_fault_t){ USER_PROGRAM + 5*1024 + 0x20, 0, 1 };
+	host_result_t res = host_stream(img, USER_PROGRAM, len, 0);
+	CHECK( res.err==FLASH_PROGRAM_ERROR && res.seq==5 && res.offset==0x20 );
+	CHECK( res.pages==5 && FlashEquals(USER_PROGRAM, img, 5*1024) );
+
+	// a stuck bit in the upper byte, found by the verify
+	img[2*1024 + 0x107] = 0x5A;
+	sim_flash_fault = (sim_flash_fault_t){ USER_PROGRAM + 2*1024 + 0x106, 0x0100, 1 };
+	res = host_stream(img, USER_PROGRAM, len, SESSION_VERIFY);
+	CHECK( res.err==FLASH_VERIFY_ERROR && res.seq==2 && res.offset==0x107 );
+	CHECK( res.pages==2 );
+	return true;
+}
+//-----------------------------------------------------------------------------
+static bool TestSkipSame(void)
+{
+	int len = 8*1024;
+	MakeImage(4, len);
+	sim_flash_write(USER_PROGRAM, img, len);
+	img[3*1024 + 5] ^= 0xFF; // one page differs
+	host_result_t res = host_stream(img, USER_PROGRAM, len, SESSION_SKIP_SAME);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.skipped==7 && res.pages==1 );
+	CHECK( sim_stats.erases==1 );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	return true;
+}
+#if UPLOAD_MANIFEST
+//-----------------------------------------------------------------------------
+// the host finds the changed pages by the manifest and sends only those
+//-----------------------------------------------------------------------------
+static bool TestSparse(void)
+{
+	int len = 12*1024, pages = 12;
+	MakeImage(5, len);
+	sim_flash_write(USER_PROGRAM, img, len);
+	img[2*1024] ^= 1;
+	img[9*1024 + 100] ^= 1;
+
+	uint8_t msg[64];
+	uint32_t hash[12];
+	host_cmd(CMD_ID_MANIFEST, 0, pages);
+	CHECK( host_msg(msg)==sizeof(cmd_t) && msg[2]==CMD_ID_MANIFEST );
+	CHECK( host_read(hash, sizeof(hash)) );
+	uint8_t send[12];
+	for (int i = 0; i < pages; i++)
+		send[i] = hash[i]!=crc_calc_sw(img + i*1024, 1024);
+	CHECK( send[2] && send[9] );
+
+	host_result_t res = host_windowed(img, USER_PROGRAM, len, SESSION_WINDOWED | SESSION_SPARSE, send);
+	CHECK( res.err==NO_ERROR );
+	CHECK( res.reports==2 && res.pages==2 );
+	CHECK( sim_stats.erases==2 );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+	return true;
+}
+#endif
+#if FLASH_DUMP
+//-----------------------------------------------------------------------------
+static bool TestDump(void)
+{
+	MakeImage(6, 1000);
+	sim_flash_write(USER_PROGRAM, img, 1000);
+	uint8_t msg[64], buf[1000];
+	host_session(CMD_ID_DUMP, 0, USER_PROGRAM, 1000, 0);
+	CHECK( host_msg(msg)==sizeof(session_t) && msg[2]==CMD_ID_DUMP );
+	CHECK( host_read(buf, 1000) );
+	CHECK( memcmp(buf, img, 1000)==0 );
+	return true;
+}
+#endif
+//-----------------------------------------------------------------------------
+static bool TestBadAddress(void)
+{
+	uint8_t msg[64];
+	host_session(CMD_ID_SESSION, 0, FLASH_BASE, 1024, 0); // the bootloader
+	CHECK( host_msg(msg)==sizeof(error_t) && msg[0]==CMD_WRONG_ADDRESS );
+	CHECK( sim_stats.erases==0 );
+	return true;
+}
+#endif // UPLOAD_V2
+#if FLASH_TIMING
+//-----------------------------------------------------------------------------
+// the scratch page must not hold application code
+//-----------------------------------------------------------------------------
+static bool TestFlashTiming(void)
+{
+	int len = 8*1024, last = info.pages - 1;
+	MakeImage(10, len);
+	sim_flash_write(USER_PROGRAM, img, len);
+	sim_flash_write(USER_PROGRAM + last*1024, img, 1024);
+
+	uint8_t msg[64];
+	host_cmd(CMD_ID_FLASH_TIMING, 3, 1); // within the application
+	CHECK( host_msg(msg)==sizeof(error_t) && msg[0]==CMD_WRONG_ADDRESS );
+	host_cmd(CMD_ID_FLASH_TIMING, 10, 1); // erased, but the last page is used
+	CHECK( host_msg(msg)==sizeof(error_t) && msg[0]==CMD_WRONG_ADDRESS );
+	host_cmd(CMD_ID_FLASH_TIMING, last, 1); // the last page itself is used
+	CHECK( host_msg(msg)==sizeof(error_t) && msg[0]==CMD_WRONG_ADDRESS );
+	CHECK( sim_stats.erases==0 && FlashEquals(USER_PROGRAM, img, len) );
+	CHECK( FlashEquals(USER_PROGRAM + last*1024, img, 1024) );
+
+	memset(img + len, 0xFF, 1024);
+	sim_flash_write(USER_PROGRAM + last*1024, img + len, 1024);
+	timing_t tm;
+	host_cmd(CMD_ID_FLASH_TIMING, last, 2);
+	CHECK( host_msg(tm.data)==sizeof(timing_t) && tm.id==CMD_ID_FLASH_TIMING );
+	CHECK( tm.err==NO_ERROR && tm.rounds==2 && tm.page==last );
+	CHECK( tm.prog_count==2*512 && tm.prog_min>=52*SIM_CYCLES_US && tm.erase_min>=20000*SIM_CYCLES_US );
+	CHECK( FlashEquals(USER_PROGRAM, img, len) );
+
+	host_cmd(CMD_ID_FLASH_TIMING, 10, 1); // now all erased from page 10 on
+	CHECK( host_msg(tm.data)==sizeof(timing_t) && tm.err==NO_ERROR && tm.rounds==1 );
+	return true;
+}
+#endif
+#if UPLOAD_STATS
+//-----------------------------------------------------------------------------
+// the application starts only after the statistics were read
+//-----------------------------------------------------------------------------
+static bool Complete(void)
+{
+	return flash_complete;
+}
+static bool TestStats(void)
+{
+	int len = 10*1024;
+	MakeImage(7, len);
+	host_result_t res = host_stream(img, USER_PROGRAM, len, 0);
+	CHECK( res.err==NO_ERROR );
+	CHECK( !sim_run(Complete, 100*SIM_CYCLES_FRAME) );
+
+	stats_t st;
+	host_cmd(CMD_ID_STATS, 0, 0);
+	CHECK( host_msg(st.data)==sizeof(stats_t) && st.id==CMD_ID_STATS );
+	CHECK( st.err==NO_ERROR && st.bytes==(uint32_t)len && st.pages==10 );
+	CHECK( st.page_min<=st.page_max && st.page_max<=st.page_sum );
+	CHECK( st.time>0 && st.time<=res.time/SIM_CYCLES_US );
+	CHECK( sim_run(Complete, 10*SIM_CYCLES_FRAME) );
+	return true;
+}
+#endif
+#if EVT_TRACE && UPLOAD_V2
+//-----------------------------------------------------------------------------
+// the trace records of an upload are read in packets
+//-----------------------------------------------------------------------------
+static bool TestEvents(void)
+{
+	MakeImage(8, 4096);
+	CHECK( host_stream(img, USER_PROGRAM, 4096, 0).err==NO_ERROR );
+	cmd_t c;
+	host_cmd(CMD_ID_EVENTS, 0, 0);
+	CHECK( host_msg(c.data)==sizeof(cmd_t) && c.id==CMD_ID_EVENTS );
+	CHECK( c.data_len>(int)(EP_DATA_LEN/sizeof(evt_t)) ); // more than one packet
+	static evt_t ev[EVT_LEN];
+	CHECK( host_read(ev, c.data_len*sizeof(evt_t)) );
+	sim_run(NULL, 10*SIM_CYCLES_FRAME);
+	CHECK( sim_in_count()==0 ); // no more than announced
+	return true;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+typedef struct test_t {
+	const char * name;
+	bool (*run)(void);
+	uint16_t flash_kb; // 0: SIM_CONFIG_DEFAULT
+} test_t;
+
+static const test_t tests[] = {
+	{ "descriptor", TestDescriptor },
+#if USB_STATS
+	{ "vendor stats", TestVendorStats },
+#endif
+#if USB_SOF_STATS && UPLOAD_V2
+	{ "frames", TestFrames },
+#endif
+	{ "v1", TestV1 },
+	{ "v1 2k pages", TestV1Pages2K, 256 },
+	{ "v1 too large", TestV1TooLarge },
+#if RAM_CODE
+	{ "irq latency", TestIrqLatency },
+#endif
+#if EP_DATA_DBL_BUF && RAM_CODE
+	{ "double buffer", TestDoubleBuffer },
+#endif
+#if UPLOAD_V2
+	{ "info", TestInfo },
+	{ "stream", TestStream },
+#if UPLOAD_LZ
+	{ "compressed", TestCompressed },
+#endif
+#if UPLOAD_DIRECT
+	{ "direct", TestDirect },
+#endif
+	{ "page crc", TestPageCrc },
+	{ "windowed", TestWindowed },
+	{ "lost packet", TestLostPacket },
+	{ "frame crc", TestBadFrameCrc },
+	{ "frame data", TestBadFrameData },
+	{ "window", TestOutOfWindow },
+	{ "duplicate", TestDuplicate },
+	{ "flash fault", TestFlashFaultWindowed },
+	{ "stream fault", TestFlashFaultStream },
+	{ "skip same", TestSkipSame },
+#if UPLOAD_MANIFEST
+	{ "sparse", TestSparse },
+#endif
+#if FLASH_DUMP
+	{ "dump", TestDump },
+#endif
+	{ "bad address", TestBadAddress },
+#endif
+#if FLASH_TIMING
+	{ "flash timing", TestFlashTiming },
+#endif
+#if UPLOAD_STATS
+	{ "stats", TestStats },
+#endif
+#if EVT_TRACE && UPLOAD_V2
+	{ "events", TestEvents },
+#endif
+};
+//-----------------------------------------------------------------------------
+int main(void)
+{
+	int failed = 0;
+	for (unsigned i = 0; i < sizeof(tests)/sizeof(tests[0]); i++)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid==0)
+		{
+			sim_config_t cfg = SIM_CONFIG_DEFAULT;
+			if (tests[i].flash_kb)
+				cfg.flash_kb = tests[i].flash_kb;
+			sim_init(&cfg);
+#if UPLOAD_V2
+			if ( !host_info(&info) )
+			{
+				fprintf(stderr, "  no answer to CMD_ID_INFO\n");
+				exit(1);
+			}
+#else	// the geometry of the simulated device
+			info.page_size = (cfg.flash_kb>128) ? 2048 : 1024;
+			info.pages = (cfg.flash_kb*1024 - BOOTLOADER_SIZE) / info.page_size;
+			info.user_start = USER_PROGRAM;
+#endif
+			memset(&sim_stats, 0, sizeof(sim_stats));
+			exit(tests[i].run() ? 0 : 1);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		bool ok = WIFEXITED(status) && WEXITSTATUS(status)==0;
+		printf("%-12s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+		failed += !ok;
+	}
+	printf("%d of %d failed\n", failed, (int)(sizeof(tests)/sizeof(tests[0])));
+	return failed ? 1 : 0;
+}